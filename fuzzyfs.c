@@ -16,25 +16,152 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 26
 #define TRUE 1
 #define FALSE 0
 
-#include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include "fuzzyfs_shm.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 static const char *DOT = ".";
 
-const char *root = NULL;
+#define MAX_LAYERS 8
+
+// A source directory.
+struct layer
+{
+	char *path;
+	int fd;
+	int mount_id;			// of path, for file handles; -1 if unknown
+};
+
+// Settings filled in from the -o mount options by fuse_opt_parse().
+struct fuzzyfs_config
+{
+	char *config;			// file with settings and mounts to serve
+	unsigned int threads;		// workers shared by all mounts
+	unsigned int cache_mem;		// MiB of directory indexes, 0 for no limit
+	char *warm_file;		// where hot corrected paths are persisted
+	char *shm_index;		// shared memory segment to publish indexes in
+	unsigned int shm_size;		// its size in MiB
+	unsigned int warm_interval;	// seconds between saves of warm_file
+	unsigned int cache_size;	// max entries in the correction cache
+	unsigned int index_threshold;	// misses before a directory is indexed
+	unsigned int cache_timeout;	// seconds to trust cached data unchecked
+	unsigned int cache_timeout_max;	// up to which directories that don't change get longer
+	char *control;			// unix socket accepting commands
+	char *log_level;		// error, warn, info or debug
+	char *collision;		// which of several case variants wins
+	unsigned int hide_duplicates;	// list one name of each set of case variants
+	unsigned int dir_fds;		// descriptors kept for recently resolved directories
+	unsigned int handles;		// reopen corrected files by file handle
+	unsigned int filter_min;	// entries from which scanned directories get a filter
+	unsigned int mph;		// index frozen directories with a minimal perfect hash
+	unsigned int compress_min;	// entries from which indexes are front coded
+	unsigned int huge_pages;	// map big index arrays on huge pages
+	unsigned int resolvers;		// big directory scans at once, off the workers
+	unsigned int bulk_threads;	// workers that may process reads at once
+};
+
+static struct fuzzyfs_config conf = {
+	.config		= NULL,
+	.threads	= 10,
+	.cache_mem	= 256,
+	.warm_file	= NULL,
+	.shm_index	= NULL,
+	.shm_size	= 16,
+	.warm_interval	= 60,
+	.cache_size	= 4096,
+	.index_threshold = 4,
+	.cache_timeout	= 0,
+	.cache_timeout_max = 0,
+	.control	= NULL,
+	.log_level	= NULL,
+	.collision	= NULL,
+	.hide_duplicates = 0,
+	.dir_fds	= 1024,
+	.handles	= 0,
+	.filter_min	= 0,
+	.mph		= 0,
+	.compress_min	= 0,
+	.huge_pages	= 1,
+	.resolvers	= 4,
+	.bulk_threads	= 0,
+};
+
+/*
+ * Settings that are applied again when the configuration file is
+ * reloaded are read through this, since they can change under running
+ * requests.
+ */
+#define TUNABLE(name) __atomic_load_n(&conf.name, __ATOMIC_RELAXED)
+
+// Messages less important than this are not logged.
+static int log_prio = LOG_INFO;
+static int log_syslog;			// log to syslog instead of stderr
+
+static const char *log_names[] = {
+	[LOG_ERR]	= "error",
+	[LOG_WARNING]	= "warn",
+	[LOG_INFO]	= "info",
+	[LOG_DEBUG]	= "debug",
+};
+
+// Returns the priority called name, or -1 if there is none.
+static int log_parse(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(log_names) / sizeof(*log_names); i++)
+		if (log_names[i] && !strcmp(log_names[i], name))
+			return i;
+	return -1;
+}
+
+static void log_msg(int prio, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// Logs a message with a syslog priority, if important enough.
+static void log_msg(int prio, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (prio > __atomic_load_n(&log_prio, __ATOMIC_RELAXED))
+		return;
+	va_start(ap, fmt);
+	if (log_syslog)
+		vsyslog(prio, fmt, ap);
+	else
+		vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
 
 /*
  * If the requested path is '/', returns a pointer to the static DOT.
@@ -56,285 +183,5215 @@ const char *fix_path(const char *path)
 	return p;
 }
 
-/* Get the correct case for a file path by searching case-insenitively for matches.
- * Input: path - a string holding the path that you want to correct the case of.
- * This will iterate over slash-delimited chunks of path. On each iteration, it corrects
- * the case of the current chunk (if correction is needed) by looking for files in the
- * current chunk's parent directory (constructed from previous case-corrected chunks) that
- * case-insensitively match the current chunk. If one is found, the current chunk is corrected.
- * This repeats until the entire path is case-corrected. The case-corrected path is returned.
- *
- * A note on memory management: this allocates new memory for the return value if it succeeds.
- * If it fails, it will free all the memory that it allocated.
-*/
-char *fix_path_case(const char *path)
+// A coarse monotonic clock in seconds, for cache timeouts.
+static time_t now(void)
 {
-	char *p;
-	DIR *dp;
-	struct dirent *de;
-	struct stat s = { 0 };
-	int len, found;
-	char *token, *parent, *saveptr;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Names and paths are hashed case-insensitively, so that those differing
+ * only in case land in the same bucket. The hash is keyed with hash_key,
+ * drawn at startup, so that names uploaded to the sources can't be
+ * crafted to collide and turn probes into scans. A path hashes by joining
+ * the hashes of its components in turn, from 0 for "", as described in
+ * fuzzyfs_shm.h; the tables only keep the low bits.
+ */
+static uint64_t hash_key[2];
+
+static uint64_t name_hash(const char *s, size_t len)
+{
+	return fuzzyfs_hash_name(hash_key, s, len);
+}
 
-	p = strdup(path);
-	token = strtok_r(p, "/", &saveptr);
-	while (token != NULL)
+static uint64_t path_hash64(const char *s, size_t len)
+{
+	uint64_t h = 0;
+	size_t start = 0, end;
+
+	while (start < len)
 	{
-		len = token - p;
-		if (len)
-			*(token - 1) = '/'; // restore delimiter
+		for (end = start; end < len && s[end] != '/'; end++)
+			;
+		if (end > start)
+			h = fuzzyfs_hash_join(hash_key, h, fuzzyfs_hash_name(hash_key, s + start, end - start));
+		start = end + 1;
+	}
+	return h;
+}
 
-		// If the current capitalization of the path (up to the current chunk) is incorrect,
-		// (that is, if getting info about the currently-specified chunk returns a nonzero exit code)
-		// Remember, strtok_r will place a null terminator after the current chunk, so we're not
-		// doing the whole path, just from the string beginning to the null terminator.
-		if (lstat(p, &s))
-		{
-			if (len)
-			{
-				// Note: this allocates new memory!
-				parent = (char*)malloc(len + 1);
-				strncpy(parent, p, len);
-				parent[len] = '\0';
-			}
-			else
-			{
-				// Note: allocates new memory.
-				parent = strdup(DOT);
-			}
+static unsigned int path_hash(const char *s, size_t len)
+{
+	return path_hash64(s, len);
+}
 
-			dp = opendir(parent);
-			if (dp == NULL)
-			{
-				free(p);
-				p = NULL;
-				free(parent);
-				parent = NULL;
-				return NULL;
-			}
+/*
+ * How a directory and everything in it is cached, chosen with policy
+ * lines in the configuration file:
+ *
+ * frozen	indexed on the first miss, never checked for changes again
+ * watched	indexed on the first miss, kept current with inotify
+ * ttl=N	cached data is trusted for N seconds, like cache_timeout
+ * nocache	neither corrections nor indexes are kept, always scan
+ * direct_io	files are opened with direct_io, bypassing the page cache
+ */
+#define POLICY_FROZEN		(1u << 0)
+#define POLICY_WATCHED		(1u << 1)
+#define POLICY_TTL		(1u << 2)
+#define POLICY_NOCACHE		(1u << 3)
+#define POLICY_DIRECT_IO	(1u << 4)
 
-			found = FALSE;
-			// Note: don't free de. It's managed separately.
-			while ((de = readdir(dp)) != NULL)
-			{
-				if (strcasecmp(de->d_name, token) == 0)
-				{
-					printf("%s --> %s\n", token, de->d_name);
-					strcpy(token, de->d_name);
-					found = TRUE;
-					break;
-				}
-			}
-			closedir(dp);
-			// parent isn't needed anymore.
-			free(parent);
-			parent = NULL;
+struct policy
+{
+	unsigned int flags;
+	unsigned int ttl;		// seconds, with POLICY_TTL
+};
 
-			if (!found)
-			{
-				free(p);
-				p = NULL;
-				return NULL;
-			}
-		}
+// Tells whether something checked at checked is still trusted under pol.
+static int policy_fresh(const struct policy *pol, time_t checked)
+{
+	unsigned int ttl;
 
-		token = strtok_r(NULL, "/", &saveptr);
-	}
+	if (pol->flags & POLICY_FROZEN)
+		return TRUE;
+	ttl = pol->flags & POLICY_TTL ? pol->ttl : TUNABLE(cache_timeout);
+	return ttl && now() - checked < ttl;
+}
 
-	return p;
+// Whether pol ever trusts cached data without checking it.
+static int policy_trusts(const struct policy *pol)
+{
+	return pol->flags & POLICY_FROZEN ||
+	       (pol->flags & POLICY_TTL ? pol->ttl : TUNABLE(cache_timeout)) != 0;
 }
 
-// Gets file attributes, correcting the path's capitalization if needed.
-static int fuzzyfs_getattr(const char *path, struct stat *stbuf)
+/*
+ * Cache of recent case corrections, keyed case-insensitively by the
+ * requested path. Entries are checked with a single lstat() before use,
+ * so a stale entry only costs one syscall before falling back to a full
+ * walk; with conf.cache_timeout, not even that if it was checked less
+ * than that many seconds ago. Hit counts are halved every time the cache
+ * is persisted, so the warm file lists recently hot paths first.
+ */
+struct pcache_entry
 {
-	int res;
-	char *p;
+	struct pcache_entry *next;	// hash chain
+	struct pcache_entry *lru_prev, *lru_next;
+	unsigned int hash;
+	unsigned long hits;
+	time_t checked;			// when corrected was last seen to exist
+	struct policy policy;		// of its directory
+	int layer;			// in which corrected exists
+	char *corrected;
+	struct file_handle *handle;	// of corrected, with conf.handles
+	char path[];
+};
 
-	p = (char*)fix_path(path);
-	res = lstat(p, stbuf);
-	if (!res)
-		return 0;
+struct pcache
+{
+	pthread_mutex_t lock;
+	struct pcache_entry **table;
+	size_t size;			// number of buckets, a power of two
+	size_t count;
+	struct pcache_entry lru;	// sentinel, lru.lru_next is the most recent
+};
 
-	if (errno != ENOENT)
-		return -errno;
+// Finds the entry for path. Must be called with pc->lock held.
+static struct pcache_entry **pcache_find(struct pcache *pc, const char *path,
+					  unsigned int hash)
+{
+	struct pcache_entry **e;
 
-	// Note: this allocates new memory for p, unless it returns an error.
-	if (!(p = fix_path_case(p)))
-		return -ENOENT;
+	if (!pc->table)
+		return NULL;
 
-	res = lstat(p, stbuf);
-	free(p);
-	p = NULL;
-	assert(res != -1);
-	return 0;
+	for (e = &pc->table[hash & (pc->size - 1)]; *e; e = &(*e)->next)
+		if ((*e)->hash == hash && strcasecmp((*e)->path, path) == 0)
+			return e;
+	return NULL;
 }
 
-// Open a directory stream and put it in fi->fh.
-static int fuzzyfs_opendir(const char *path, struct fuse_file_info *fi)
+static void pcache_unlink(struct pcache *pc, struct pcache_entry **e)
 {
-	DIR *dp;
-	char *p;
+	struct pcache_entry *old = *e;
 
-	p = (char*)fix_path(path);
-	dp = opendir(p);
-	if (dp == NULL)
-	{
-		if (errno != ENOENT)
-			return -errno;
+	*e = old->next;
+	old->lru_prev->lru_next = old->lru_next;
+	old->lru_next->lru_prev = old->lru_prev;
+	pc->count--;
+	free(old->corrected);
+	free(old->handle);
+	free(old);
+}
+
+// Counts a hit of e and moves it to the front of the LRU list.
+static void pcache_hit(struct pcache *pc, struct pcache_entry *e)
+{
+	e->hits++;
+	e->lru_prev->lru_next = e->lru_next;
+	e->lru_next->lru_prev = e->lru_prev;
+	e->lru_next = pc->lru.lru_next;
+	e->lru_prev = &pc->lru;
+	pc->lru.lru_next->lru_prev = e;
+	pc->lru.lru_next = e;
+}
 
-		// Note: allocates new memory for p.
-		if (!(p = fix_path_case(p)))
-			return -ENOENT;
+/*
+ * Returns a newly allocated copy of the cached correction for path,
+ * whose path_hash() is hash, or NULL if there is none, and sets *layer
+ * to its layer. *fresh tells
+ * whether it was checked recently enough to be used without checking
+ * again. Counts as a hit.
+ */
+static char *pcache_lookup(struct pcache *pc, const char *path, unsigned int hash,
+			   int *layer, int *fresh)
+{
+	struct pcache_entry **e, *hit;
+	char *res = NULL;
 
-		dp = opendir(p);
-		// fix_path_case allocated new memory. Free it.
-		free(p);
-		p = NULL;
+	pthread_mutex_lock(&pc->lock);
+	if ((e = pcache_find(pc, path, hash)) != NULL)
+	{
+		hit = *e;
+		pcache_hit(pc, hit);
+		res = strdup(hit->corrected);
+		*layer = hit->layer;
+		*fresh = policy_fresh(&hit->policy, hit->checked);
 	}
-	// fi->fh is a uint64_t, so we must cast. Casting directly to uint64_t
-	// generates a compiler warning, so we use uintptr_t.
-	fi->fh = (uintptr_t) dp;
-	assert(dp != NULL);
-	return 0;
+	pthread_mutex_unlock(&pc->lock);
+	return res;
 }
 
-// Reads the contents of a directory.
-static int fuzzyfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			   off_t offset, struct fuse_file_info *fi)
+/*
+ * Remembers that path (whose path_hash() is hash) resolves to corrected
+ * in layer, adding hits to its count, along with the file handle of
+ * corrected if not NULL, which is taken over. Without the policy of its
+ * directory, only an existing entry is updated, keeping its policy.
+ */
+static void pcache_insert(struct pcache *pc, const char *path, unsigned int hash,
+			  const char *corrected, int layer, unsigned long hits,
+			  const struct policy *pol, struct file_handle *handle)
 {
-	(void) path;
-	(void) offset;
+	struct pcache_entry **e, *n;
+	size_t i;
 
-	struct dirent *de;
+	if (!TUNABLE(cache_size) || (pol && (pol->flags & POLICY_NOCACHE)))
+	{
+		free(handle);
+		return;
+	}
 
-	// Including an intermediate unitptr_t cast avoids a compiler warning.
-	while ((de = readdir((DIR*)(uintptr_t)fi->fh)) != NULL)
+	pthread_mutex_lock(&pc->lock);
+	if (!pc->table)
 	{
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
+		// roughly one entry per bucket when full
+		for (pc->size = 64; pc->size < conf.cache_size; pc->size <<= 1)
+			;
+		pc->table = calloc(pc->size, sizeof(*pc->table));
+		if (!pc->table)
+			goto out;
 	}
 
-	return 0;
+	if ((e = pcache_find(pc, path, hash)) != NULL)
+	{
+		n = *e;
+		n->hits += hits;
+		n->layer = layer;
+		n->checked = now();
+		if (pol)
+			n->policy = *pol;
+		if (strcmp(n->corrected, corrected) != 0)
+		{
+			char *c = strdup(corrected);
+			if (c)
+			{
+				free(n->corrected);
+				n->corrected = c;
+			}
+			free(n->handle);
+			n->handle = NULL;
+		}
+		if (handle)
+		{
+			free(n->handle);
+			n->handle = handle;
+			handle = NULL;
+		}
+		goto out;
+	}
+
+	if (!pol || !(n = malloc(sizeof(*n) + strlen(path) + 1)))
+		goto out;
+	if (!(n->corrected = strdup(corrected)))
+	{
+		free(n);
+		goto out;
+	}
+	strcpy(n->path, path);
+	n->handle = handle;
+	handle = NULL;
+	n->hash = hash;
+	n->hits = hits;
+	n->layer = layer;
+	n->checked = now();
+	n->policy = *pol;
+	i = hash & (pc->size - 1);
+	n->next = pc->table[i];
+	pc->table[i] = n;
+	n->lru_next = pc->lru.lru_next;
+	n->lru_prev = &pc->lru;
+	pc->lru.lru_next->lru_prev = n;
+	pc->lru.lru_next = n;
+	pc->count++;
+
+	// evict the least recently used entries
+	while (pc->count > TUNABLE(cache_size))
+	{
+		struct pcache_entry *old = pc->lru.lru_prev;
+		pcache_unlink(pc, pcache_find(pc, old->path, old->hash));
+	}
+out:
+	pthread_mutex_unlock(&pc->lock);
+	free(handle);
 }
 
-// Close the directory stream pointed to by fi->fh.
-static int fuzzyfs_releasedir(const char *path, struct fuse_file_info *fi)
+static void pcache_remove(struct pcache *pc, const char *path, unsigned int hash)
 {
-	(void) path;
+	struct pcache_entry **e;
 
-	int res;
+	pthread_mutex_lock(&pc->lock);
+	if ((e = pcache_find(pc, path, hash)) != NULL)
+		pcache_unlink(pc, e);
+	pthread_mutex_unlock(&pc->lock);
+}
 
-	// Including an intermediate unitptr_t cast avoids a compiler warning.
-	res = closedir((DIR*)(uintptr_t)fi->fh);
-	if (res == -1)
-		res = -errno;
+/*
+ * A minimal perfect hash of a set of keys, built like BBHash: each level
+ * is a bit array about twice as long as the keys left, in which each key
+ * sets the bit it hashes to. Keys alone on their bit are done; those
+ * that collide try again on the next level. The rank of a key's bit
+ * among all the set bits is then a number below the number of keys,
+ * different for each. Keys not in the set may land on any bit, so the
+ * caller must check what it finds there.
+ */
+#define MPH_LEVELS	24
 
-	return res;
-}
+struct dmph
+{
+	unsigned int keys;
+	unsigned int levels;
+	size_t start[MPH_LEVELS + 1];	// first bit of each level, and the end
+	uint32_t *ranks;		// set bits before each block of 512
+	uint16_t *offsets;		// and before each word, within its block
+	uint64_t bits[];
+};
 
-// Open a file handle and put it in fi->fh.
-static int fuzzyfs_open(const char *path, struct fuse_file_info *fi)
+/*
+ * A folded-name index of one directory of one source: an open addressing
+ * hash table mapping the case-insensitive hash of each name to its
+ * spelling there. Parts are immutable once built, and kept in dparts by
+ * the device and inode of the directory so that every tree having it in
+ * a layer shares them: a source common to several mounts is read and
+ * charged to mem_used once. A part is current as long as the directory's
+ * mtime is the one it was read at.
+ */
+struct dpart
 {
-	int res;
-	char *p;
+	int refs;			// under dparts.lock
+	size_t bytes;			// charged to mem_used
+	struct dpart *next;		// in its bucket of dparts
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;		// of the directory when it was read
+	unsigned int count;		// number of names
+	unsigned int mask;		// number of slots - 1
+	struct
+	{
+		unsigned int hash;
+		unsigned int name;	// offset into names, + 1; 0 if empty
+	} *slots;
+	char *names;
+	/*
+	 * With conf.mph, parts of frozen directories use a minimal perfect
+	 * hash of their names instead of slots, ranked holding the offset of
+	 * each name in rank order.
+	 */
+	struct dmph *mph;
+	unsigned int *ranked;
+	/*
+	 * With conf.compress_min, large directories keep their names front
+	 * coded in names instead, sorted case-insensitively, and blocks holds
+	 * the offset of every DINDEX_BLOCK-th. An entry is the length of the
+	 * prefix it shares with the previous one, then the length and bytes
+	 * of the rest.
+	 */
+	unsigned int *blocks;
+};
 
-	p = (char*)fix_path(path);
-	res = open(p, fi->flags);
+#define DINDEX_BLOCK 16
+#define DPART_BUCKETS 1024
 
-	if (res != -1)
-	{
-		fi->fh = res;
-		return 0;
-	}
+// Every part in use, by device and inode.
+static struct
+{
+	pthread_mutex_t lock;
+	struct dpart *bucket[DPART_BUCKETS];
+} dparts = { PTHREAD_MUTEX_INITIALIZER, { NULL } };
 
-	if (errno != ENOENT)
-		return -errno;
+/*
+ * A merged index of one directory across the layers of a tree: the part
+ * of each layer it was read from, which a lookup probes in priority
+ * order. Indexes are thrown away as soon as the directory's inode or
+ * mtime in one of the layers shows that it changed.
+ */
+struct dindex
+{
+	int refs;
+	size_t bytes;			// charged to mem_used, its parts aside
+	time_t checked;			// when it was last found to be current
+	unsigned int gen;		// of its node when it was read
+	unsigned int layers;		// layers the directory was read from
+	struct dpart *part[MAX_LAYERS];
+};
 
-	// Allocates new memory for p.
-	if (!(p = fix_path_case(p)))
-		return -ENOENT;
+/*
+ * A name found in an index: its spelling in each layer that has it,
+ * highest priority first. Those of compressed parts are decoded to buf.
+ */
+struct dindex_match
+{
+	unsigned int count;
+	unsigned int layer[MAX_LAYERS];
+	const char *name[MAX_LAYERS];
+	char buf[MAX_LAYERS][NAME_MAX + 1];
+};
 
-	res = open(p, fi->flags);
-	free(p);
-	p = NULL;
-	fi->fh = res;
-	assert(res != -1);
-	return 0;
-}
+/*
+ * A snapshot of the merged listing of a directory, as readdir() returns
+ * it, so that directories listed over and over are read once. Like
+ * indexes, snapshots are immutable, charged to mem_used, and thrown away
+ * as soon as the directory's inode or mtime in one of the layers changes.
+ */
+struct dlisting
+{
+	int refs;
+	size_t bytes;			// charged to mem_used
+	time_t checked;			// when it was last found to be current
+	unsigned int gen;		// of its node when it was read
+	int hidden;			// taken with hide_duplicates
+	unsigned int layers;		// layers the directory was read from
+	struct
+	{
+		struct timespec mtime;
+		ino_t ino;
+	} stamp[MAX_LAYERS];
+	unsigned int count;
+	struct dlisting_ent
+	{
+		ino_t ino;
+		unsigned int name;	// offset into names
+		unsigned char type;	// DT_*
+	} *ents;
+	char *names;
+};
 
-// Read size bytes from the given file descriptor into the buffer buf, beginning offset bytes into the file.
-static int fuzzyfs_read(const char *path, char *buf, size_t size, off_t offset,
-			struct fuse_file_info *fi)
+/*
+ * A Bloom filter of the names in one layer of a directory too big to be
+ * worth indexing, taken while scanning it, so that names it does not
+ * have are answered without reading it again. Like indexes, filters are
+ * immutable, charged to mem_used, and thrown away as soon as the
+ * directory's inode or mtime changes.
+ */
+struct dfilter
 {
-	(void) path;
+	int refs;
+	size_t bytes;			// charged to mem_used
+	time_t checked;			// when it was last found to be current
+	struct timespec mtime;		// of the directory when it was read
+	ino_t ino;
+	size_t mask;			// number of bits - 1
+	uint64_t bits[];
+};
 
-	int res;
+/*
+ * A directory opened through fuzzyfs, or recently resolved by a lookup:
+ * its real path and an O_PATH descriptor in every layer that has it,
+ * shared by all handles open on it. While it is kept, lookups of paths
+ * under the directory start from there rather than from the root, and
+ * files in it are reached relative to it, as long as its policy or
+ * conf.cache_timeout trusts it for a while: checking it every time would
+ * walk its path as far as it saves. Layers in which the directory only
+ * appears later are not seen until it is dropped.
+ * Those no handle has open are closed least recently used first to stay
+ * within conf.dir_fds.
+ */
+struct dopen
+{
+	int refs;
+	unsigned int handles;		// open handles, under dc->lock
+	unsigned int live;		// layers that have the directory
+	time_t checked;			// when its real paths were last found to be current
+	int fd[MAX_LAYERS];		// of each live layer
+	ino_t ino[MAX_LAYERS];
+	char *real[MAX_LAYERS];		// of each live layer
+	char path[];			// as requested, the key of its node
+};
 
-	res = pread(fi->fh, buf, size, offset);
-	if (res == -1)
-		res = -errno;
+/*
+ * Every directory in which a lookup had to fall back to a scan gets a
+ * node counting those misses. Only once a node crosses
+ * conf.index_threshold is a dindex built for it; until then lookups
+ * scan the directory, stopping at the first match under COLLISION_EXACT
+ * unless a filter is being built, since the vast majority of requests
+ * use the exact case and never get here.
+ * Nodes are keyed case-insensitively by the requested directory path,
+ * which stands for the merged directory of all layers.
+ * Every change seen to the directory gives its node a new generation, and
+ * the index and listing of the directory are only current while they
+ * were read at the node's generation. If the directory is watched, that
+ * is all there is to check; otherwise its mtime is checked as well.
+ */
+struct dnode
+{
+	struct dnode *next;		// hash chain
+	struct dnode *lru_prev, *lru_next;
+	unsigned int hash;
+	unsigned int misses;
+	unsigned int epoch;		// policy_epoch policy was found at
+	struct policy policy;
+	unsigned int gen;		// from dc->gen, new on every change seen
+	int watched;			// inotify tells us of every change
+	time_t changed;			// when a change was last seen, or it was created
+	struct dindex *index;
+	struct dlisting *listing;
+	struct dopen *open;		// while some handle has it open
+	unsigned int filters;		// layers with a filter
+	struct dfilter *filter[MAX_LAYERS];
+	char path[];
+};
 
-	return res;
-}
+struct dcache
+{
+	pthread_mutex_t lock;
+	struct dnode **table;
+	size_t size;			// number of buckets, a power of two
+	size_t count;
+	unsigned int opened;		// nodes with a dopen
+	unsigned int gen;		// last node generation given out
+	struct dnode lru;		// sentinel, lru.lru_next is the most recent
+};
 
-// Close the file descriptor.
-static int fuzzyfs_release(const char *path, struct fuse_file_info *fi)
+/*
+ * A shared memory segment in which a tree publishes its directory
+ * indexes for other processes, see fuzzyfs_shm.h.
+ */
+/*
+ * The layout of the segment is kept here too, and only ever read from
+ * here: the mapping is what other processes see, not what we trust.
+ */
+struct shm_index
 {
-	(void) path;
+	pthread_mutex_t lock;		// serializes writers in this process
+	struct fuzzyfs_shm *shm;
+	struct fuzzyfs_shm_slot *slots;
+	uint32_t nslots;		// a power of two
+	char *names;
+	uint32_t names_size;
+	uint32_t names_used;
+	unsigned int used;		// slots in use
+};
 
-	int res;
+/*
+ * The source directories of a mount, highest priority first, and
+ * everything cached about them. Mounts of the same list of directories
+ * share one tree, and with it their caches and directory indexes.
+ */
+struct tree
+{
+	struct tree *next;
+	struct layer layers[MAX_LAYERS];
+	unsigned int nlayers;
+	char *warm_file;		// where hot corrected paths are persisted
+	int warming;			// whether warm_thread() was started
+	struct shm_index *shm;		// where indexes are published, or NULL
+	struct
+	{
+		unsigned long lookups;		// paths that needed correcting
+		unsigned long cache_hits;	// answered by the correction cache
+		unsigned long index_hits;	// components answered by an index
+		unsigned long scans;		// directories scanned for a component
+		unsigned long builds;		// indexes built
+		unsigned long filter_hits;	// scans saved by a filter
+	} stats;
+	struct pcache pcache;
+	struct dcache dcache;
+};
 
-	res = close(fi->fh);
-	if (res == -1)
-		res = -errno;
+static struct tree *trees;
 
-	return res;
+#define STAT_INC(t, counter) __atomic_add_fetch(&(t)->stats.counter, 1, __ATOMIC_RELAXED)
+
+/*
+ * With conf.handles, corrected files are also remembered by file handle,
+ * so that opening them again takes no path walk, however deep they are,
+ * and still finds them if they were renamed meanwhile. Opening a handle
+ * needs CAP_DAC_READ_SEARCH; without it, handles are given up for good
+ * on the first EPERM and files are opened by path again.
+ */
+static int handles_denied;
+
+// Returns the mount id of the directory fd, or -1 if it has none.
+static int handle_mount(int fd)
+{
+	struct file_handle *h;
+	int id = -1;
+
+	if (!(h = malloc(sizeof(*h) + MAX_HANDLE_SZ)))
+		return -1;
+	h->handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(fd, "", h, &id, AT_EMPTY_PATH) == -1)
+		id = -1;
+	free(h);
+	return id;
 }
 
 /*
- * A function called at the filesystem startup.
- * Changes directory to the first argument (the source) so that
- * we can assume that the source is '.', instead of doing nasty
- * directory-symlink appending.
+ * Returns a newly allocated file handle of what opening path in layer
+ * l opens, or NULL if handles are not used or it has none.
  */
-static void *fuzzyfs_init(struct fuse_conn_info *conn)
+static struct file_handle *handle_get(struct tree *t, int l, const char *path)
 {
-	// cd into the root directory, wherever that is.
-	if (chdir(root) == -1)
+	struct file_handle *h, *n;
+	int id;
+
+	if (!TUNABLE(handles) || __atomic_load_n(&handles_denied, __ATOMIC_RELAXED) ||
+	    t->layers[l].mount_id == -1 || !(h = malloc(sizeof(*h) + MAX_HANDLE_SZ)))
+		return NULL;
+	h->handle_bytes = MAX_HANDLE_SZ;
+
+	// a handle can only be opened through the mount it comes from
+	if (name_to_handle_at(t->layers[l].fd, path, h, &id, AT_SYMLINK_FOLLOW) == -1 ||
+	    id != t->layers[l].mount_id)
 	{
-		perror("chdir");
-		exit(1);
+		free(h);
+		return NULL;
 	}
-
-	return NULL;
+	if ((n = realloc(h, sizeof(*h) + h->handle_bytes)) != NULL)
+		h = n;
+	return h;
 }
 
-// Parse the arguments. Notably, sets root to the first argument (the source).
-static int fuzzyfs_opt_parse(void *data, const char *arg, int key,
-			     struct fuse_args *outargs)
+/*
+ * Opens the file the cached correction for path leads to through its
+ * handle, if it has one and can be trusted without checking.
+ * Returns the descriptor, or -1.
+ */
+static int pcache_open(struct tree *t, const char *path, int flags)
 {
-	// Note: this will be triggered only by the first argument.
-	if (!root && key == FUSE_OPT_KEY_NONOPT)
+	struct pcache *pc = &t->pcache;
+	struct pcache_entry **e;
+	union
 	{
-		// when fuse starts, it changes the workdir to the root
-		// so we must resolve relative paths beforehand
-		if (!(root = realpath(arg, NULL)))
-		{
-			perror(outargs->argv[0]);
-			exit(1);
-		}
-		return 0;
+		struct file_handle h;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} u;
+	unsigned int hash;
+	int layer = -1, fd;
+
+	if (!TUNABLE(handles) || __atomic_load_n(&handles_denied, __ATOMIC_RELAXED))
+		return -1;
+
+	hash = path_hash(path, strlen(path));
+	pthread_mutex_lock(&pc->lock);
+	if ((e = pcache_find(pc, path, hash)) != NULL && (*e)->handle &&
+	    policy_fresh(&(*e)->policy, (*e)->checked))
+	{
+		pcache_hit(pc, *e);
+		memcpy(&u.h, (*e)->handle, sizeof(u.h) + (*e)->handle->handle_bytes);
+		layer = (*e)->layer;
 	}
+	pthread_mutex_unlock(&pc->lock);
+	if (layer == -1)
+		return -1;
 
-	return 1;
+	STAT_INC(t, lookups);
+	STAT_INC(t, cache_hits);
+	if ((fd = open_by_handle_at(t->layers[layer].fd, &u.h, flags)) == -1)
+	{
+		if (errno == EPERM && !__atomic_exchange_n(&handles_denied, TRUE, __ATOMIC_RELAXED))
+			log_msg(LOG_WARNING, "not permitted to open file handles, opening by path\n");
+		else if (errno == ESTALE)
+			pcache_remove(pc, path, hash);
+	}
+	return fd;
 }
 
-// Setup the mapping between the fuse functions and the fuzzyfs functions.
-static struct fuse_operations fuzzyfs_oper = {
+// A mountpoint served by this process.
+struct mount
+{
+	struct mount *next;
+	char *mountpoint;
+	struct tree *tree;
+	struct fuse_args args;		// fuse options for this mount only
+	struct fuse_chan *ch;
+	struct fuse *fuse;
+	struct fuse_session *se;
+	int gone;			// unmounted, its channel is closed
+};
+
+static struct mount *mounts;
+
+/*
+ * The request loop shared by all mounts: conf.threads workers wait on
+ * the channels of every mount at once and process whatever request
+ * comes in first, so idle mounts cost no threads. Signals are handled
+ * by the main thread, which hears of them through a pipe.
+ */
+static struct
+{
+	int epfd;
+	int wake[2];			// readable once we are exiting
+	int retire[2];			// each byte in it stops one worker
+	int sig[2];			// signals caught, one byte each
+	size_t bufsize;			// largest request of any mount
+	unsigned int active;		// mounts that are not gone
+	int multithreaded;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;		// signalled when a worker stops
+	unsigned int workers;		// workers that are not retiring
+	unsigned int running;		// workers that have not stopped yet
+	struct bulk *queue, **queue_tail;	// bulk requests waiting, oldest first
+	unsigned int queued;		// how many
+	unsigned int bulk;		// bulk requests being processed
+} loop = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.queue_tail = &loop.queue,
+};
+
+static __thread int loop_self;		// the current thread is a worker
+
+// Tells whether path is prefix, or something under it. DOT is the root.
+static int path_under(const char *path, const char *prefix)
+{
+	size_t len = strlen(prefix);
+
+	if (prefix == DOT || !len)
+		return TRUE;
+	return !strncasecmp(path, prefix, len) && (!path[len] || path[len] == '/');
+}
+
+/*
+ * A policy line of the configuration file. Its path is either under a
+ * mountpoint, and applies to that mount, or relative to the sources of
+ * every mount. The rule with the longest matching path wins.
+ */
+struct policy_rule
+{
+	struct policy_rule *next;
+	char *path;			// without trailing slashes, "" for the root
+	struct policy policy;
+};
+
+static struct policy_rule *policy_rules;
+static pthread_rwlock_t policy_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int policy_epoch = 1;	// bumped whenever the rules change
+static unsigned int policy_any;		// flags used by some rule
+
+/*
+ * Finds the policy of path, relative to the sources of t. This walks
+ * all the rules, so it is only done once per directory node or cache
+ * entry, see dnode_policy().
+ */
+static void policy_get(struct tree *t, const char *path, struct policy *pol)
+{
+	struct policy_rule *r;
+	struct mount *m;
+	const char *prefix;
+	size_t best = 0, len, mlen;
+	int found = FALSE;
+
+	pol->flags = 0;
+	pol->ttl = 0;
+	pthread_rwlock_rdlock(&policy_lock);
+	for (r = policy_rules; r; r = r->next)
+	{
+		prefix = r->path;
+		if (prefix[0] == '/')
+		{
+			for (m = mounts; m; m = m->next)
+			{
+				mlen = strcmp(m->mountpoint, "/") ? strlen(m->mountpoint) : 0;
+				if (m->tree == t && !strncmp(prefix, m->mountpoint, mlen) &&
+				    (!prefix[mlen] || prefix[mlen] == '/'))
+					break;
+			}
+			if (!m)
+				continue;
+			prefix += prefix[mlen] ? mlen + 1 : mlen;
+		}
+		len = strlen(prefix);
+		if (path_under(path, prefix) && (!found || len >= best))
+		{
+			*pol = r->policy;
+			best = len;
+			found = TRUE;
+		}
+	}
+	pthread_rwlock_unlock(&policy_lock);
+}
+
+static void policy_free(struct policy_rule *rules)
+{
+	struct policy_rule *r;
+
+	while ((r = rules) != NULL)
+	{
+		rules = r->next;
+		free(r->path);
+		free(r);
+	}
+}
+
+// Replaces the rules with rules, freeing the old ones.
+static void policy_set(struct policy_rule *rules)
+{
+	struct policy_rule *old, *r;
+	unsigned int any = 0;
+
+	for (r = rules; r; r = r->next)
+		any |= r->policy.flags;
+	pthread_rwlock_wrlock(&policy_lock);
+	old = policy_rules;
+	policy_rules = rules;
+	__atomic_store_n(&policy_any, any, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&policy_epoch, 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&policy_lock);
+	policy_free(old);
+}
+
+/*
+ * Parses the kinds (comma-separated) of a policy line for path into a new
+ * rule. Returns NULL if they are not valid.
+ */
+static struct policy_rule *policy_parse(const char *path, char *kinds)
+{
+	struct policy_rule *r;
+	char *kind, *saveptr, *end;
+	size_t len = strlen(path);
+
+	if (!(r = calloc(1, sizeof(*r))))
+		return NULL;
+	for (kind = strtok_r(kinds, ",", &saveptr); kind; kind = strtok_r(NULL, ",", &saveptr))
+	{
+		if (!strcmp(kind, "frozen"))
+			r->policy.flags |= POLICY_FROZEN;
+		else if (!strcmp(kind, "watched"))
+			r->policy.flags |= POLICY_WATCHED;
+		else if (!strcmp(kind, "nocache"))
+			r->policy.flags |= POLICY_NOCACHE;
+		else if (!strcmp(kind, "direct_io"))
+			r->policy.flags |= POLICY_DIRECT_IO;
+		else if (!strncmp(kind, "ttl=", 4) && kind[4] &&
+			 (r->policy.ttl = strtoul(kind + 4, &end, 10), !*end))
+			r->policy.flags |= POLICY_TTL;
+		else
+			goto fail;
+	}
+
+	if (path[0] != '/' && !strcmp(path, DOT))
+		len = 0;
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	if (!r->policy.flags || !(r->path = strndup(path, len)))
+		goto fail;
+	return r;
+
+fail:
+	free(r);
+	return NULL;
+}
+
+/*
+ * State of a path being resolved: for each layer in which the prefix
+ * resolved so far exists, the real (case-corrected) path in that layer.
+ * Case folding never changes lengths, so each of them is as long as the
+ * requested path, which they all start out as a copy of.
+ * A walk starting from an open directory resolves what is under it
+ * relative to its descriptors.
+ */
+struct walk
+{
+	struct tree *t;
+	unsigned int live;		// layers in which the prefix exists
+	char *real[MAX_LAYERS];
+	size_t base;			// length of the path of open, 0 if none
+	struct dopen *open;
+};
+
+/*
+ * A component of a path being resolved, path[start, end), its
+ * name_hash(), and the path_hash() of the whole path up to its end,
+ * path[0, end). Paths are never copied or modified to be tokenized.
+ */
+struct token
+{
+	size_t start, end;
+	uint64_t hash;
+	unsigned int prefix;
+};
+
+/*
+ * The components of a path, all found and hashed in a single pass, so
+ * that every cache keyed by the path or one of its directories is probed
+ * without hashing it again. hash is the path_hash() of the whole path.
+ */
+struct tokens
+{
+	size_t count;
+	unsigned int hash;
+	struct token *tk;
+	struct token local[32];		// enough for most paths
+};
+
+// Splits path into ts. Returns FALSE if out of memory.
+static int tokenize(const char *path, struct tokens *ts)
+{
+	struct token *tk;
+	uint64_t h = 0, c;
+	size_t pos = 0, max = strlen(path) / 2 + 1;
+
+	ts->tk = ts->local;
+	ts->count = 0;
+	if (max > sizeof(ts->local) / sizeof(ts->local[0]) &&
+	    !(ts->tk = malloc(max * sizeof(*ts->tk))))
+		return FALSE;
+
+	for (;;)
+	{
+		while (path[pos] == '/')
+			pos++;
+		if (!path[pos])
+			break;
+		tk = &ts->tk[ts->count++];
+		tk->start = pos;
+		while (path[pos] && path[pos] != '/')
+			pos++;
+		tk->end = pos;
+		c = fuzzyfs_hash_name(hash_key, path + tk->start, pos - tk->start);
+		h = fuzzyfs_hash_join(hash_key, h, c);
+		tk->hash = c;
+		tk->prefix = h;
+	}
+	ts->hash = h;
+	return TRUE;
+}
+
+static void tokens_free(struct tokens *ts)
+{
+	if (ts->tk != ts->local)
+		free(ts->tk);
+}
+
+// Bytes held by the directory indexes of all trees, limited by conf.cache_mem.
+static size_t mem_used;
+
+/*
+ * Descriptors held by the open directories of all trees, limited by
+ * conf.dir_fds but also to a quarter of RLIMIT_NOFILE, which leaves the
+ * rest to the files and directories being served.
+ */
+static size_t dir_fds_used;
+static rlim_t nofile = 1024;
+static pthread_once_t nofile_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Reads the soft limit on descriptors, raising it as far as the hard one
+ * allows if raise: once a directory is first kept open for lookups.
+ */
+static void nofile_set(int raise)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	if (raise && rl.rlim_cur < rl.rlim_max)
+	{
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1 && getrlimit(RLIMIT_NOFILE, &rl) == -1)
+			return;
+	}
+	nofile = rl.rlim_cur;
+}
+
+static void nofile_raise(void)
+{
+	nofile_set(TRUE);
+}
+
+static size_t dir_fds_limit(void)
+{
+	size_t limit = TUNABLE(dir_fds);
+
+	return limit < nofile / 4 ? limit : nofile / 4;
+}
+
+/*
+ * Index arrays are probed all over, and each 4KiB page of them takes a
+ * TLB entry. With conf.huge_pages, those of HUGE_PAGE bytes or more are
+ * mapped on huge pages: reserved ones (vm.nr_hugepages) while there are
+ * any, transparent ones otherwise. Every block starts with the length of
+ * its mapping, 0 if it came from malloc() instead.
+ */
+#define HUGE_PAGE (2UL << 20)
+#define ARENA_HEADER 16
+
+// Returns size zeroed bytes for an index, or NULL.
+static void *arena_alloc(size_t size)
+{
+	size_t len = size + ARENA_HEADER, skip;
+	char *p, *a;
+
+	if (TUNABLE(huge_pages) && size >= HUGE_PAGE)
+	{
+		len = (len + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		// a transparent huge page needs an aligned 2MiB of the mapping
+		if (p == MAP_FAILED &&
+		    (a = mmap(NULL, len + HUGE_PAGE, PROT_READ | PROT_WRITE,
+			      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+		{
+			p = (char *)(((uintptr_t)a + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+			if ((skip = p - a) != 0)
+				munmap(a, skip);
+			if (skip != HUGE_PAGE)
+				munmap(p + len, HUGE_PAGE - skip);
+			madvise(p, len, MADV_HUGEPAGE);
+		}
+		if (p != MAP_FAILED)
+		{
+			*(size_t *)p = len;
+			return p + ARENA_HEADER;
+		}
+		len = size + ARENA_HEADER;
+	}
+	if (!(p = calloc(1, len)))
+		return NULL;
+	return p + ARENA_HEADER;
+}
+
+static void arena_free(void *ptr)
+{
+	char *p = ptr;
+
+	if (!p)
+		return;
+	p -= ARENA_HEADER;
+	if (*(size_t *)p)
+		munmap(p, *(size_t *)p);
+	else
+		free(p);
+}
+
+static void dpart_free(struct dpart *p)
+{
+	if (p)
+	{
+		__atomic_sub_fetch(&mem_used, p->bytes, __ATOMIC_RELAXED);
+		arena_free(p->slots);
+		arena_free(p->names);
+		if (p->mph)
+		{
+			free(p->mph->ranks);
+			free(p->mph->offsets);
+		}
+		free(p->mph);
+		arena_free(p->ranked);
+		free(p->blocks);
+		free(p);
+	}
+}
+
+static unsigned int dpart_bucket(dev_t dev, ino_t ino)
+{
+	uint64_t key = (uint64_t)dev * 0x9e3779b97f4a7c15ull ^ ino;
+
+	return (key ^ key >> 29) % DPART_BUCKETS;
+}
+
+/*
+ * Returns the part of the directory s is the stat of with a reference
+ * for the caller, if there is a current one.
+ */
+static struct dpart *dpart_find(const struct stat *s)
+{
+	struct dpart *p;
+
+	pthread_mutex_lock(&dparts.lock);
+	for (p = dparts.bucket[dpart_bucket(s->st_dev, s->st_ino)]; p; p = p->next)
+	{
+		if (p->dev == s->st_dev && p->ino == s->st_ino)
+		{
+			if (p->mtime.tv_sec == s->st_mtim.tv_sec && p->mtime.tv_nsec == s->st_mtim.tv_nsec)
+				p->refs++;
+			else
+				p = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dparts.lock);
+	return p;
+}
+
+// Shares p, just built, in place of any older part of its directory.
+static void dpart_add(struct dpart *p)
+{
+	struct dpart **e;
+
+	pthread_mutex_lock(&dparts.lock);
+	for (e = &dparts.bucket[dpart_bucket(p->dev, p->ino)]; *e; e = &(*e)->next)
+	{
+		if ((*e)->dev == p->dev && (*e)->ino == p->ino)
+		{
+			*e = (*e)->next;
+			break;
+		}
+	}
+	p->next = dparts.bucket[dpart_bucket(p->dev, p->ino)];
+	dparts.bucket[dpart_bucket(p->dev, p->ino)] = p;
+	pthread_mutex_unlock(&dparts.lock);
+}
+
+// Parts are freed by the last index using them, and forgotten then.
+static void dpart_put(struct dpart *p)
+{
+	struct dpart **e;
+	int last;
+
+	pthread_mutex_lock(&dparts.lock);
+	if ((last = --p->refs == 0))
+	{
+		for (e = &dparts.bucket[dpart_bucket(p->dev, p->ino)]; *e && *e != p; e = &(*e)->next)
+			;
+		if (*e)
+			*e = p->next;
+	}
+	pthread_mutex_unlock(&dparts.lock);
+	if (last)
+		dpart_free(p);
+}
+
+static void dindex_free(struct dindex *idx)
+{
+	unsigned int l;
+
+	if (idx)
+	{
+		__atomic_sub_fetch(&mem_used, idx->bytes, __ATOMIC_RELAXED);
+		for (l = 0; l < MAX_LAYERS; l++)
+			if (idx->part[l])
+				dpart_put(idx->part[l]);
+		free(idx);
+	}
+}
+
+// Indexes are shared by lookups in flight and freed by the last of them.
+static void dindex_get(struct dindex *idx)
+{
+	__atomic_add_fetch(&idx->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void dindex_put(struct dindex *idx)
+{
+	if (__atomic_sub_fetch(&idx->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		dindex_free(idx);
+}
+
+static void dlisting_put(struct dlisting *ls)
+{
+	if (__atomic_sub_fetch(&ls->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		__atomic_sub_fetch(&mem_used, ls->bytes, __ATOMIC_RELAXED);
+		free(ls->ents);
+		free(ls->names);
+		free(ls);
+	}
+}
+
+static void dfilter_put(struct dfilter *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		__atomic_sub_fetch(&mem_used, f->bytes, __ATOMIC_RELAXED);
+		free(f);
+	}
+}
+
+// Drops whatever n caches about the directory. Called with dc->lock held.
+static void dnode_drop(struct dnode *n)
+{
+	unsigned int l;
+
+	if (n->index)
+		dindex_put(n->index);
+	if (n->listing)
+		dlisting_put(n->listing);
+	for (l = 0; l < MAX_LAYERS; l++)
+		if (n->filters & (1u << l))
+			dfilter_put(n->filter[l]);
+	n->index = NULL;
+	n->listing = NULL;
+	n->filters = 0;
+}
+
+static void dopen_put(struct dopen *o)
+{
+	unsigned int l;
+
+	if (__atomic_sub_fetch(&o->refs, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		for (l = 0; l < MAX_LAYERS; l++)
+			if (o->live & (1u << l))
+				close(o->fd[l]);
+		free(o);
+	}
+}
+
+// Keeps o as the open directory of n. Called with dc->lock held.
+static void dnode_open(struct dcache *dc, struct dnode *n, struct dopen *o)
+{
+	__atomic_add_fetch(&o->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dir_fds_used, __builtin_popcount(o->live), __ATOMIC_RELAXED);
+	n->open = o;
+	dc->opened++;
+}
+
+// Forgets the open directory of n; its handles keep it. Called with dc->lock held.
+static void dnode_close(struct dcache *dc, struct dnode *n)
+{
+	if (n->open)
+	{
+		__atomic_sub_fetch(&dir_fds_used, __builtin_popcount(n->open->live), __ATOMIC_RELAXED);
+		dopen_put(n->open);
+		n->open = NULL;
+		dc->opened--;
+	}
+}
+
+// The bit key hashes to on level i of m.
+static size_t dmph_bit(const struct dmph *m, unsigned int i, uint64_t key)
+{
+	size_t size = m->start[i + 1] - m->start[i];
+
+	// murmur3's finalizer, so that each level spreads the keys anew
+	key ^= (i + 1) * 0x9e3779b97f4a7c15ull;
+	key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdull;
+	key = (key ^ (key >> 33)) * 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return m->start[i] + (size_t)(((unsigned __int128)key * size) >> 64);
+}
+
+// Returns the rank of key in m, or UINT_MAX if it is on none of the bits.
+static unsigned int dmph_find(const struct dmph *m, uint64_t key)
+{
+	size_t bit;
+	unsigned int i, rank;
+
+	for (i = 0; i < m->levels; i++)
+	{
+		bit = dmph_bit(m, i, key);
+		if (!(m->bits[bit / 64] & (uint64_t)1 << (bit % 64)))
+			continue;
+		rank = m->ranks[bit / 512] + m->offsets[bit / 64];
+		return rank + __builtin_popcountll(m->bits[bit / 64] & (((uint64_t)1 << (bit % 64)) - 1));
+	}
+	return UINT_MAX;
+}
+
+/*
+ * Builds the minimal perfect hash of the count distinct keys. Returns
+ * NULL if out of memory, or if some keys are left after the last level,
+ * which only happens when two of them are equal.
+ */
+static struct dmph *dmph_build(const uint64_t *keys, unsigned int count)
+{
+	struct dmph *m, *n;
+	uint64_t *left, *dup = NULL, *d;
+	size_t size, bit, w, words = 0;
+	unsigned int i, k, nleft = count, rank;
+
+	if (!(m = calloc(1, sizeof(*m))) || !(left = malloc(count * sizeof(*left))))
+	{
+		free(m);
+		return NULL;
+	}
+	memcpy(left, keys, count * sizeof(*left));
+	m->keys = count;
+
+	for (i = 0; nleft && i < MPH_LEVELS; i++)
+	{
+		// whole blocks of 512 bits, so that levels don't share them
+		size = ((size_t)nleft * 2 + 511) / 512 * 512;
+		if (!(n = realloc(m, sizeof(*m) + (words + size / 64) * sizeof(uint64_t))))
+			goto fail;
+		m = n;
+		if (!(d = realloc(dup, size / 8)))
+			goto fail;
+		dup = d;
+		memset(m->bits + words, 0, size / 8);
+		memset(dup, 0, size / 8);
+		m->start[i] = words * 64;
+		m->start[i + 1] = words * 64 + size;
+		m->levels = i + 1;
+
+		for (k = 0; k < nleft; k++)
+		{
+			bit = dmph_bit(m, i, left[k]) - words * 64;
+			if (m->bits[words + bit / 64] & (uint64_t)1 << (bit % 64))
+				dup[bit / 64] |= (uint64_t)1 << (bit % 64);
+			m->bits[words + bit / 64] |= (uint64_t)1 << (bit % 64);
+		}
+		for (w = 0; w < size / 64; w++)
+			m->bits[words + w] &= ~dup[w];
+
+		// those that collided go on to the next level
+		for (k = 0, count = nleft, nleft = 0; k < count; k++)
+		{
+			bit = dmph_bit(m, i, left[k]) - words * 64;
+			if (dup[bit / 64] & (uint64_t)1 << (bit % 64))
+				left[nleft++] = left[k];
+		}
+		words += size / 64;
+	}
+	if (nleft || !(m->ranks = malloc((words / 8 + 1) * sizeof(*m->ranks))) ||
+	    !(m->offsets = malloc((words + 1) * sizeof(*m->offsets))))
+		goto fail;
+	for (w = 0, rank = 0; w < words; w++)
+	{
+		if (w % 8 == 0)
+			m->ranks[w / 8] = rank;
+		m->offsets[w] = rank - m->ranks[w / 8];
+		rank += __builtin_popcountll(m->bits[w]);
+	}
+	free(left);
+	free(dup);
+	return m;
+
+fail:
+	free(left);
+	free(dup);
+	free(m->ranks);
+	free(m);
+	return NULL;
+}
+
+// Bytes used by m.
+static size_t dmph_bytes(const struct dmph *m)
+{
+	size_t words = m->start[m->levels] / 64;
+
+	return sizeof(*m) + words * sizeof(uint64_t) + (words / 8 + 1) * sizeof(*m->ranks) +
+	       (words + 1) * sizeof(*m->offsets);
+}
+
+#define FOLD(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 'a' - 'A' : (c))
+
+// Orders a[0..alen) and b[0..blen) ignoring ASCII case, as compressed indexes sort names.
+static int fold_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	size_t i;
+	int x, y;
+
+	for (i = 0; i < alen && i < blen; i++)
+	{
+		x = FOLD((unsigned char)a[i]);
+		y = FOLD((unsigned char)b[i]);
+		if (x != y)
+			return x - y;
+	}
+	return (alen > blen) - (alen < blen);
+}
+
+/*
+ * Decodes the compressed entry at p into buf, which holds the previous
+ * entry's name, and its length into *len. Returns where the next entry
+ * starts.
+ */
+static const unsigned char *dpart_decode(const unsigned char *p, char *buf, size_t *len)
+{
+	*len = p[0] + p[1];
+	memcpy(buf + p[0], p + 2, p[1]);
+	buf[*len] = '\0';
+	return p + 2 + p[1];
+}
+
+// How many leading bytes of a[0..alen) and b[0..blen), from the first from on, are equal ignoring ASCII case.
+static size_t fold_prefix(const char *a, size_t alen, const char *b, size_t blen, size_t from)
+{
+	while (from < alen && from < blen &&
+	       FOLD((unsigned char)a[from]) == FOLD((unsigned char)b[from]))
+		from++;
+	return from;
+}
+
+// Whether a[0..alen) sorts before b[0..blen), the first eq bytes being equal.
+static int fold_before(const char *a, size_t alen, const char *b, size_t blen, size_t eq)
+{
+	return eq < blen && (eq == alen || FOLD((unsigned char)a[eq]) < FOLD((unsigned char)b[eq]));
+}
+
+/*
+ * Binary searches the first names of the blocks of compressed p, then
+ * scans one, decoding into buf. Whatever prefix name is known to share
+ * with the names around the one compared is not compared again: names
+ * sort between their neighbours, and entries repeat the prefix of the
+ * previous one.
+ */
+static int dpart_search(const struct dpart *p, const char *name, size_t len, char *buf)
+{
+	const unsigned char *e;
+	unsigned int lo = 0, hi = (p->count - 1) / DINDEX_BLOCK + 1, mid, i;
+	size_t n, eq, lo_eq = 0, hi_eq = 0;
+
+	// the last block whose first name is not after name
+	while (hi - lo > 1)
+	{
+		mid = lo + (hi - lo) / 2;
+		e = (const unsigned char *)p->names + p->blocks[mid];
+		eq = fold_prefix(name, len, (const char *)e + 2, e[1], lo_eq < hi_eq ? lo_eq : hi_eq);
+		if (fold_before(name, len, (const char *)e + 2, e[1], eq))
+		{
+			hi = mid;
+			hi_eq = eq;
+		}
+		else
+		{
+			lo = mid;
+			lo_eq = eq;
+		}
+	}
+
+	e = (const unsigned char *)p->names + p->blocks[lo];
+	eq = lo_eq;
+	for (i = lo * DINDEX_BLOCK; i < p->count && i < (lo + 1) * DINDEX_BLOCK; i++)
+	{
+		if (eq > e[0] && i % DINDEX_BLOCK)
+			eq = e[0];
+		e = dpart_decode(e, buf, &n);
+		eq = fold_prefix(name, len, buf, n, eq);
+		if (eq == len && eq == n)
+			return TRUE;
+		if (fold_before(name, len, buf, n, eq))
+			return FALSE;
+	}
+	return FALSE;
+}
+
+/*
+ * Returns the spelling in p of the name matching name[0..len)
+ * case-insensitively, whose name_hash() is hash, or NULL if there is
+ * none. Those of compressed parts are decoded to buf, NAME_MAX + 1 bytes.
+ */
+static const char *dpart_lookup(const struct dpart *p, const char *name, size_t len,
+				uint64_t hash, char *buf)
+{
+	const char *s;
+	unsigned int i;
+
+	if (p->blocks)
+		return dpart_search(p, name, len, buf) ? buf : NULL;
+
+	if (p->mph)
+	{
+		if ((i = dmph_find(p->mph, hash)) == UINT_MAX)
+			return NULL;
+		s = p->names + p->ranked[i];
+		return strncasecmp(s, name, len) || s[len] ? NULL : s;
+	}
+
+	for (i = hash & p->mask; p->slots[i].name; i = (i + 1) & p->mask)
+	{
+		s = p->names + p->slots[i].name - 1;
+		if (p->slots[i].hash == (unsigned int)hash && strncasecmp(s, name, len) == 0 && !s[len])
+			return s;
+	}
+	return NULL;
+}
+
+// The number of positions of p, for dpart_name().
+static unsigned int dpart_size(const struct dpart *p)
+{
+	return p->blocks || p->mph ? p->count : p->mask + 1;
+}
+
+// Returns the name at position i of p, decoded to buf if need be, or NULL if there is none there.
+static const char *dpart_name(const struct dpart *p, unsigned int i, char *buf)
+{
+	const unsigned char *e;
+	unsigned int k;
+	size_t n;
+
+	if (p->blocks)
+	{
+		e = (const unsigned char *)p->names + p->blocks[i / DINDEX_BLOCK];
+		for (k = 0; k <= i % DINDEX_BLOCK; k++)
+			e = dpart_decode(e, buf, &n);
+		return buf;
+	}
+	if (p->mph)
+		return p->names + p->ranked[i];
+	return p->slots[i].name ? p->names + p->slots[i].name - 1 : NULL;
+}
+
+/*
+ * Fills m with the spellings in idx of the name matching name[0..len)
+ * case-insensitively, whose name_hash() is hash. Returns whether there
+ * is one.
+ */
+static int dindex_lookup(const struct dindex *idx, const char *name, size_t len,
+			 uint64_t hash, struct dindex_match *m)
+{
+	unsigned int l;
+
+	m->count = 0;
+	for (l = 0; idx->layers >> l; l++)
+	{
+		if (idx->layers & (1u << l) &&
+		    (m->name[m->count] = dpart_lookup(idx->part[l], name, len, hash,
+						      m->buf[m->count])) != NULL)
+			m->layer[m->count++] = l;
+	}
+	return m->count > 0;
+}
+
+// The number of positions of idx, for dindex_entry().
+static unsigned int dindex_size(const struct dindex *idx)
+{
+	unsigned int l, size = 0;
+
+	for (l = 0; idx->layers >> l; l++)
+		if (idx->layers & (1u << l))
+			size += dpart_size(idx->part[l]);
+	return size;
+}
+
+/*
+ * Fills m with the name at position i of idx. Returns FALSE if there is
+ * none there, or if it is listed at the position of a layer of higher
+ * priority that has it too.
+ */
+static int dindex_entry(const struct dindex *idx, unsigned int i, struct dindex_match *m)
+{
+	const char *name;
+	unsigned int l;
+	char buf[NAME_MAX + 1];
+
+	for (l = 0; idx->layers >> l; l++)
+	{
+		if (!(idx->layers & (1u << l)))
+			continue;
+		if (i < dpart_size(idx->part[l]))
+			break;
+		i -= dpart_size(idx->part[l]);
+	}
+	if (!(idx->layers >> l) || !(name = dpart_name(idx->part[l], i, buf)))
+		return FALSE;
+	return dindex_lookup(idx, name, strlen(name), name_hash(name, strlen(name)), m) &&
+	       m->layer[0] == l;
+}
+
+/*
+ * Returns the descriptor the path real[l][0..len) of w is relative to,
+ * pointing *rel at that relative path, which the caller terminates.
+ */
+static int walk_at(struct walk *w, unsigned int l, size_t len, const char **rel)
+{
+	if (w->base && len >= w->base)
+	{
+		*rel = len > w->base ? w->real[l] + w->base + 1 : DOT;
+		return w->open->fd[l];
+	}
+	*rel = len ? w->real[l] : DOT;
+	return w->t->layers[l].fd;
+}
+
+/*
+ * Opens the directory at real[l][0..len) of w. len is 0 for the root.
+ * Returns NULL with errno set on failure.
+ */
+static DIR *walk_opendir(struct walk *w, unsigned int l, size_t len)
+{
+	const char *rel;
+	DIR *dp;
+	int fd = walk_at(w, l, len, &rel);
+	char c = w->real[l][len];
+
+	w->real[l][len] = '\0';
+	fd = openat(fd, rel, O_RDONLY | O_DIRECTORY);
+	w->real[l][len] = c;
+	if (fd == -1)
+		return NULL;
+	if (!(dp = fdopendir(fd)))
+		close(fd);
+	return dp;
+}
+
+/*
+ * When a directory holds several names differing only in case, and none
+ * of them is the requested one, the collision setting picks the winner:
+ *
+ * exact	a name with the requested case always wins, as found
+ *		without looking at the directory; otherwise the lowest
+ *		in strcmp() order
+ * lexical	the lowest in strcmp() order, whatever case was requested
+ * newest	the one modified last, whatever case was requested
+ *
+ * With lexical and newest every component is thus looked up in its
+ * directory's index, which is built on the first lookup.
+ */
+enum { COLLISION_EXACT, COLLISION_LEXICAL, COLLISION_NEWEST };
+
+static const char *collision_names[] = { "exact", "lexical", "newest" };
+static int collision = COLLISION_EXACT;
+
+/*
+ * Tells whether the name a in the directory dfd wins over b, which
+ * matches it case-insensitively and was read before it.
+ */
+static int collision_better(int dfd, const char *a, const char *b)
+{
+	struct stat sa, sb;
+
+	if (collision == COLLISION_EXACT)
+		return FALSE;
+	if (collision == COLLISION_NEWEST &&
+	    !fstatat(dfd, a, &sa, AT_SYMLINK_NOFOLLOW) &&
+	    !fstatat(dfd, b, &sb, AT_SYMLINK_NOFOLLOW) &&
+	    (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec || sa.st_mtim.tv_nsec != sb.st_mtim.tv_nsec))
+		return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ||
+		       (sa.st_mtim.tv_sec == sb.st_mtim.tv_sec && sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec);
+	return strcmp(a, b) < 0;
+}
+
+/*
+ * Scans of big directories that aren't cached yet can take long, and
+ * would hold up the worker doing them and so every request behind it,
+ * even reads and cache hits. A worker about to do such a scan thus
+ * leaves the request loop for the resolver pool, and a spare worker is
+ * started to take its place until it is back. At most conf.resolvers
+ * scans run at once, the others wait for their turn by priority: the
+ * lookups of requests first, then the indexes of listings, then
+ * warming. As many may wait with a spare standing in for them; beyond
+ * that a worker waits in place, holding the kernel back rather than
+ * starting threads without bound. Directories of less than RESOLVE_MIN
+ * bytes, roughly a thousand entries on most file systems, are scanned
+ * right away, where a spare would cost more than the scan.
+ */
+enum { RESOLVE_LOOKUP, RESOLVE_LIST, RESOLVE_WARM, RESOLVE_PRIOS };
+
+#define RESOLVE_MIN	32768
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t turn[RESOLVE_PRIOS];	// signalled when one may start
+	unsigned int running;		// scans in progress
+	unsigned int waiting[RESOLVE_PRIOS];	// scans waiting for their turn
+	unsigned int spares;		// workers standing in for resolvers
+} resolve = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.turn = { PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+		  PTHREAD_COND_INITIALIZER },
+};
+
+static __thread int resolve_prio;	// of the scans of the current thread
+
+static void *loop_worker(void *arg);
+
+/*
+ * Waits for the turn of a scan by the current thread of a directory of
+ * size bytes. Returns what to pass to resolve_leave() once it is done.
+ */
+static int resolve_enter(off_t size)
+{
+	unsigned int max = TUNABLE(resolvers), p = resolve_prio, q;
+	pthread_attr_t attr;
+	pthread_t th;
+	int spare = FALSE;
+
+	if (size < RESOLVE_MIN)
+		return -1;
+
+	pthread_mutex_lock(&resolve.lock);
+	if (max && loop_self && loop.multithreaded && resolve.spares < 2 * max)
+	{
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_mutex_lock(&loop.lock);
+		if (pthread_create(&th, &attr, loop_worker, NULL) == 0)
+		{
+			loop.running++;
+			resolve.spares++;
+			spare = TRUE;
+		}
+		pthread_mutex_unlock(&loop.lock);
+		pthread_attr_destroy(&attr);
+	}
+
+	resolve.waiting[p]++;
+	for (;;)
+	{
+		// 0 lets every scan go, it may have been reloaded so
+		if (!(max = TUNABLE(resolvers)))
+			break;
+		for (q = 0; q < p && !resolve.waiting[q]; q++)
+			;
+		if (q == p && resolve.running < max)
+			break;
+		pthread_cond_wait(&resolve.turn[p], &resolve.lock);
+	}
+	resolve.waiting[p]--;
+	resolve.running++;
+	pthread_mutex_unlock(&resolve.lock);
+	return spare;
+}
+
+// Ends a scan that got its turn from resolve_enter(), which returned how.
+static void resolve_leave(int how)
+{
+	unsigned int p;
+	int err = errno;
+
+	if (how == -1)
+		return;
+
+	pthread_mutex_lock(&resolve.lock);
+	resolve.running--;
+	for (p = 0; p < RESOLVE_PRIOS && !resolve.waiting[p]; p++)
+		;
+	if (p < RESOLVE_PRIOS)
+		pthread_cond_signal(&resolve.turn[p]);
+	// back in the loop, so one worker too many
+	if (how)
+	{
+		resolve.spares--;
+		if (write(loop.retire[1], "", 1) != 1)
+			log_msg(LOG_WARNING, "fuzzyfs: can't retire a spare worker\n");
+	}
+	pthread_mutex_unlock(&resolve.lock);
+	errno = err;
+}
+
+/*
+ * Reads the rest of dp, the directory s is the stat of, into a new part.
+ * When several entries match case-insensitively, the collision setting
+ * picks the one kept, just like a plain scan. Returns NULL with errno set
+ * on failure.
+ */
+static struct dpart *dpart_scan(DIR *dp, const struct stat *s)
+{
+	struct dpart *p;
+	struct dirent *de;
+	size_t used = 0, cap = 4096, count = 0, size, off;
+	unsigned int hash, j;
+	char *names = NULL, *n, *c = NULL;
+
+	if (!(p = calloc(1, sizeof(*p))) || !(names = malloc(cap)))
+		goto fail;
+	p->dev = s->st_dev;
+	p->ino = s->st_ino;
+	p->mtime = s->st_mtim;
+
+	while ((de = readdir(dp)) != NULL)
+	{
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		size = strlen(de->d_name) + 1;
+		if (used + size > cap)
+		{
+			while (used + size > cap)
+				cap <<= 1;
+			if (!(n = realloc(names, cap)))
+				goto fail;
+			names = n;
+		}
+		memcpy(names + used, de->d_name, size);
+		used += size;
+		count++;
+	}
+
+	// into the part's arena, without what the buffer was overallocated by
+	if (!(p->names = arena_alloc(used)))
+		goto fail;
+	memcpy(p->names, names, used);
+	free(names);
+	names = NULL;
+
+	// keep the table at most half full
+	for (p->mask = 15; p->mask < count * 2; p->mask = p->mask * 2 + 1)
+		;
+	if (!(p->slots = arena_alloc((p->mask + 1) * sizeof(*p->slots))))
+		goto fail;
+	for (off = 0; off < used; off += strlen(p->names + off) + 1)
+	{
+		hash = name_hash(p->names + off, strlen(p->names + off));
+		for (j = hash & p->mask; p->slots[j].name; j = (j + 1) & p->mask)
+		{
+			c = p->names + p->slots[j].name - 1;
+			if (p->slots[j].hash == hash && !strcasecmp(c, p->names + off))
+				break;
+		}
+		if (!p->slots[j].name)
+		{
+			p->slots[j].hash = hash;
+			p->slots[j].name = off + 1;
+			p->count++;
+		}
+		else if (collision_better(dirfd(dp), p->names + off, c))
+			p->slots[j].name = off + 1;
+	}
+	p->refs = 1;
+	p->bytes = sizeof(*p) + used + (p->mask + 1) * sizeof(*p->slots);
+	__atomic_add_fetch(&mem_used, p->bytes, __ATOMIC_RELAXED);
+	return p;
+
+fail:
+	free(names);
+	dpart_free(p);
+	return NULL;
+}
+
+/*
+ * Replaces the slots of p, not shared yet, by a minimal perfect hash of
+ * its names. Leaves p as it is if that can't be done.
+ */
+static void dpart_compact(struct dpart *p)
+{
+	struct dmph *m = NULL;
+	uint64_t *keys;
+	unsigned int *ranked = NULL, *off, i, k = 0;
+	size_t bytes;
+
+	keys = malloc(p->count * sizeof(*keys));
+	off = malloc(p->count * sizeof(*off));
+	if (!keys || !off)
+		goto out;
+
+	for (i = 0; i <= p->mask; i++)
+	{
+		if (!p->slots[i].name)
+			continue;
+		off[k] = p->slots[i].name - 1;
+		keys[k] = name_hash(p->names + off[k], strlen(p->names + off[k]));
+		k++;
+	}
+	if (!k || !(m = dmph_build(keys, k)) || !(ranked = arena_alloc(k * sizeof(*ranked))))
+		goto out;
+	for (i = 0; i < k; i++)
+		ranked[dmph_find(m, keys[i])] = off[i];
+
+	bytes = p->bytes - (p->mask + 1) * sizeof(*p->slots) + k * sizeof(*ranked) + dmph_bytes(m);
+	__atomic_add_fetch(&mem_used, bytes - p->bytes, __ATOMIC_RELAXED);
+	p->bytes = bytes;
+	arena_free(p->slots);
+	p->slots = NULL;
+	p->mask = 0;
+	p->ranked = ranked;
+	p->mph = m;
+	m = NULL;
+out:
+	if (m)
+	{
+		free(m->ranks);
+		free(m->offsets);
+	}
+	free(m);
+	free(keys);
+	free(off);
+}
+
+struct dpart_head
+{
+	const char *name;
+	size_t len;
+};
+
+static int dpart_head_cmp(const void *a, const void *b)
+{
+	const struct dpart_head *x = a, *y = b;
+
+	return fold_cmp(x->name, x->len, y->name, y->len);
+}
+
+/*
+ * Replaces the slots and names of p, not shared yet, by its names front
+ * coded in sorted blocks. Leaves p as it is if that can't be done.
+ */
+static void dpart_compress(struct dpart *p)
+{
+	struct dpart_head *heads;
+	unsigned int *blocks = NULL, i, k = 0;
+	unsigned char *names = NULL, *e;
+	char *arena = NULL;
+	const char *prev = "";
+	size_t cap = 0, shared, used, bytes;
+
+	if (!(heads = malloc(p->count * sizeof(*heads))))
+		return;
+	for (i = 0; i <= p->mask; i++)
+	{
+		if (!p->slots[i].name)
+			continue;
+		heads[k].name = p->names + p->slots[i].name - 1;
+		heads[k].len = strlen(heads[k].name);
+		// lengths are stored in a byte
+		if (heads[k].len > NAME_MAX)
+			goto out;
+		cap += 2 + heads[k++].len;
+	}
+	qsort(heads, k, sizeof(*heads), dpart_head_cmp);
+
+	if (!k || !(blocks = malloc(((k - 1) / DINDEX_BLOCK + 1) * sizeof(*blocks))) ||
+	    !(names = malloc(cap)))
+		goto out;
+
+	for (i = 0, e = names; i < k; i++)
+	{
+		shared = 0;
+		if (i % DINDEX_BLOCK)
+			while (prev[shared] && prev[shared] == heads[i].name[shared])
+				shared++;
+		else
+			blocks[i / DINDEX_BLOCK] = e - names;
+		*e++ = shared;
+		*e++ = heads[i].len - shared;
+		memcpy(e, heads[i].name + shared, heads[i].len - shared);
+		e += heads[i].len - shared;
+		prev = heads[i].name;
+	}
+	// into the part's arena, without what the bound overestimated
+	used = e - names;
+	if (!(arena = arena_alloc(used)))
+		goto out;
+	memcpy(arena, names, used);
+
+	bytes = sizeof(*p) + used + ((k - 1) / DINDEX_BLOCK + 1) * sizeof(*blocks);
+	__atomic_add_fetch(&mem_used, bytes - p->bytes, __ATOMIC_RELAXED);
+	p->bytes = bytes;
+	arena_free(p->slots);
+	arena_free(p->names);
+	p->slots = NULL;
+	p->mask = 0;
+	p->names = arena;
+	p->blocks = blocks;
+	blocks = NULL;
+out:
+	free(names);
+	free(blocks);
+	free(heads);
+}
+
+/*
+ * Indexes the directory at real[l][0..len) of every layer l in w->live,
+ * reading only the layers whose part is not current. New parts take the
+ * form conf and flags, the policy of the directory, call for. Returns
+ * NULL with errno set on failure.
+ */
+static struct dindex *dindex_build(struct walk *w, size_t len, unsigned int flags)
+{
+	struct dindex *idx;
+	struct dpart *p;
+	struct stat s;
+	unsigned int l;
+	int turn, err;
+	DIR *dp;
+
+	if (!(idx = calloc(1, sizeof(*idx))))
+		return NULL;
+	idx->refs = 1;
+	idx->bytes = sizeof(*idx);
+	__atomic_add_fetch(&mem_used, idx->bytes, __ATOMIC_RELAXED);
+
+	for (l = 0; l < w->t->nlayers; l++)
+	{
+		if (!(w->live & (1u << l)))
+			continue;
+		if (!(dp = walk_opendir(w, l, len)))
+			goto fail;
+
+		// Stat before reading, so changes made during the scan invalidate it.
+		if (fstat(dirfd(dp), &s) == -1)
+			p = NULL;
+		else if (!(p = dpart_find(&s)))
+		{
+			turn = resolve_enter(s.st_size);
+			p = dpart_scan(dp, &s);
+			resolve_leave(turn);
+			if (p)
+			{
+				STAT_INC(w->t, builds);
+				if (TUNABLE(compress_min) && p->count >= TUNABLE(compress_min))
+					dpart_compress(p);
+				if (!p->blocks && flags & POLICY_FROZEN && TUNABLE(mph))
+					dpart_compact(p);
+				dpart_add(p);
+			}
+		}
+		err = errno;
+		closedir(dp);
+		errno = err;
+		if (!p)
+			goto fail;
+		idx->part[l] = p;
+		idx->layers |= 1u << l;
+	}
+	idx->checked = now();
+	return idx;
+
+fail:
+	err = errno;
+	dindex_put(idx);
+	errno = err;
+	return NULL;
+}
+
+// Makes n the most recently used node. Called with dc->lock held.
+static void dcache_touch(struct dcache *dc, struct dnode *n)
+{
+	n->lru_prev->lru_next = n->lru_next;
+	n->lru_next->lru_prev = n->lru_prev;
+	n->lru_next = dc->lru.lru_next;
+	n->lru_prev = &dc->lru;
+	dc->lru.lru_next->lru_prev = n;
+	dc->lru.lru_next = n;
+}
+
+/*
+ * Finds the node for dir[0..len), whose path_hash() is hash, if there is
+ * one. Called with dc->lock held.
+ */
+static struct dnode *dcache_lookup(struct dcache *dc, const char *dir, size_t len,
+				   unsigned int hash)
+{
+	struct dnode *n;
+
+	if (!dc->table)
+		return NULL;
+	for (n = dc->table[hash & (dc->size - 1)]; n; n = n->next)
+		if (n->hash == hash && strncasecmp(n->path, dir, len) == 0 && !n->path[len])
+			return n;
+	return NULL;
+}
+
+// Finds the node for dir, if there is one. Called with dc->lock held.
+static struct dnode *dcache_find(struct dcache *dc, const char *dir)
+{
+	return dcache_lookup(dc, dir, strlen(dir), path_hash(dir, strlen(dir)));
+}
+
+/*
+ * Directories with the watched policy get an inotify watch in every layer
+ * before they are indexed. Any change gives the node of the directory a
+ * new generation and drops what it caches, which is otherwise trusted
+ * without checking the directory's mtime.
+ *
+ * Several trees, or several spellings of a directory in one, may watch
+ * the same directory, and inotify gives them all the same wd: each of
+ * them has an entry of its own, and every event goes to all of them.
+ * A wd is removed with the last of its entries, when their nodes are
+ * forgotten.
+ */
+struct watch
+{
+	struct watch *next;		// in the chain of its wd
+	struct watch *dir_next;		// in the chain of its directory
+	int wd;
+	struct dcache *dc;		// of the tree watching
+	unsigned int hash;		// path_hash() of dir
+	char dir[];			// as requested
+};
+
+#define WATCH_BUCKETS 1024
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static struct
+{
+	pthread_once_t once;
+	int fd;
+	pthread_mutex_t lock;
+	struct watch *table[WATCH_BUCKETS];	// by wd
+	struct watch *dirs[WATCH_BUCKETS];	// by directory
+	unsigned int count;
+} watcher = {
+	.once = PTHREAD_ONCE_INIT,
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Tells whether some entry uses wd. Called with watcher.lock held.
+static int watch_used(int wd)
+{
+	struct watch *e;
+
+	for (e = watcher.table[wd % WATCH_BUCKETS]; e; e = e->next)
+		if (e->wd == wd)
+			return TRUE;
+	return FALSE;
+}
+
+// Takes w out of both of its chains. Called with watcher.lock held.
+static void watch_unlink(struct watch *w)
+{
+	struct watch **e;
+
+	for (e = &watcher.table[w->wd % WATCH_BUCKETS]; *e != w; e = &(*e)->next)
+		;
+	*e = w->next;
+	for (e = &watcher.dirs[w->hash % WATCH_BUCKETS]; *e != w; e = &(*e)->dir_next)
+		;
+	*e = w->dir_next;
+	watcher.count--;
+}
+
+/*
+ * Forgets the entries of the directory requested as dir (whose
+ * path_hash() is hash) in dc, removing the watches nobody else uses.
+ * Called when its node is, with dc->lock held.
+ */
+static void watch_forget(struct dcache *dc, const char *dir, unsigned int hash)
+{
+	struct watch **e, *w;
+
+	if (!__atomic_load_n(&watcher.count, __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&watcher.lock);
+	for (e = &watcher.dirs[hash % WATCH_BUCKETS]; *e; )
+	{
+		w = *e;
+		if (w->dc != dc || w->hash != hash || strcmp(w->dir, dir))
+		{
+			e = &w->dir_next;
+			continue;
+		}
+		watch_unlink(w);
+		if (!watch_used(w->wd))
+			inotify_rm_watch(watcher.fd, w->wd);
+		free(w);
+	}
+	pthread_mutex_unlock(&watcher.lock);
+}
+
+/*
+ * Finds the node for dir[0..len), whose path_hash() is hash, creating it
+ * if needed. Called with dc->lock held.
+ */
+static struct dnode *dcache_get(struct dcache *dc, const char *dir, size_t len,
+				unsigned int hash)
+{
+	struct dnode *n;
+	size_t i;
+
+	if (!dc->table)
+	{
+		for (dc->size = 64; dc->size < conf.cache_size; dc->size <<= 1)
+			;
+		if (!(dc->table = calloc(dc->size, sizeof(*dc->table))))
+			return NULL;
+	}
+
+	// dir is only the first len bytes of the requested path
+	if (!(n = dcache_lookup(dc, dir, len, hash)) &&
+	    (n = calloc(1, sizeof(*n) + len + 1)) != NULL)
+	{
+		memcpy(n->path, dir, len);
+		n->hash = hash;
+		n->gen = ++dc->gen;
+		n->changed = now();
+		i = hash & (dc->size - 1);
+		n->next = dc->table[i];
+		dc->table[i] = n;
+		dc->count++;
+		n->lru_next = n->lru_prev = n;
+	}
+	if (!n)
+		return NULL;
+	dcache_touch(dc, n);
+
+	// forget the least recently used directories
+	while (dc->count > TUNABLE(cache_size) && dc->lru.lru_prev != n)
+	{
+		struct dnode *old = dc->lru.lru_prev, **e;
+
+		for (e = &dc->table[old->hash & (dc->size - 1)]; *e != old; e = &(*e)->next)
+			;
+		*e = old->next;
+		old->lru_prev->lru_next = old->lru_next;
+		old->lru_next->lru_prev = old->lru_prev;
+		dc->count--;
+		dnode_drop(old);
+		dnode_close(dc, old);
+		watch_forget(dc, old->path, old->hash);
+		free(old);
+	}
+	return n;
+}
+
+/*
+ * Drops directory indexes, listings and filters, least recently used
+ * first and round robin over all trees, until the memory they use is
+ * back under 7/8 of conf.cache_mem. Those in use by a request are freed
+ * once it is done.
+ */
+static void mem_reclaim(void)
+{
+	size_t limit = (size_t)TUNABLE(cache_mem) << 20;
+	struct dnode *n;
+	struct tree *t;
+	int dropped = TRUE;
+
+	while (dropped && __atomic_load_n(&mem_used, __ATOMIC_RELAXED) > limit / 8 * 7)
+	{
+		dropped = FALSE;
+		for (t = trees; t; t = t->next)
+		{
+			pthread_mutex_lock(&t->dcache.lock);
+			for (n = t->dcache.lru.lru_prev; n != &t->dcache.lru; n = n->lru_prev)
+			{
+				if (n->index || n->listing || n->filters)
+				{
+					dnode_drop(n);
+					dropped = TRUE;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&t->dcache.lock);
+		}
+	}
+}
+
+/*
+ * Closes the descriptors of directories no handle has open, least
+ * recently used first and round robin over all trees, until those kept
+ * are back under the limit.
+ */
+static void dir_fds_reclaim(void)
+{
+	size_t limit = dir_fds_limit();
+	struct dnode *n;
+	struct tree *t;
+	int dropped = TRUE;
+
+	while (dropped && __atomic_load_n(&dir_fds_used, __ATOMIC_RELAXED) > limit)
+	{
+		dropped = FALSE;
+		for (t = trees; t; t = t->next)
+		{
+			pthread_mutex_lock(&t->dcache.lock);
+			for (n = t->dcache.lru.lru_prev; n != &t->dcache.lru; n = n->lru_prev)
+			{
+				if (n->open && !n->open->handles)
+				{
+					dnode_close(&t->dcache, n);
+					dropped = TRUE;
+					break;
+				}
+			}
+			pthread_mutex_unlock(&t->dcache.lock);
+		}
+	}
+}
+
+// Empties the segment. Called with si->lock held.
+static void shm_clear(struct shm_index *si)
+{
+	struct fuzzyfs_shm *shm = si->shm;
+
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset(si->slots, 0, si->nslots * sizeof(struct fuzzyfs_shm_slot));
+	shm->names_used = si->names_used = 0;
+	si->used = 0;
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Stores name[0..len) as the real name in layer of the path hashing to
+ * hash. Called with si->lock held. Returns -1 if the segment is full.
+ */
+static int shm_put(struct shm_index *si, uint64_t hash, unsigned int layer,
+		   const char *name, size_t len)
+{
+	struct fuzzyfs_shm_slot *slot = NULL;
+	char *names = si->names;
+	uint32_t i, n, off, seq;
+
+	if (!hash)
+		hash = 1;
+	// bounded, should the slots have been scribbled over
+	for (i = hash & (si->nslots - 1), n = 0; n < si->nslots; i = (i + 1) & (si->nslots - 1), n++)
+	{
+		slot = &si->slots[i];
+		if (!slot->hash || (slot->hash == hash && slot->layer == layer))
+			break;
+	}
+	if (n == si->nslots)
+		return -1;
+
+	if (slot->hash && slot->len == len && slot->name <= si->names_used &&
+	    len <= si->names_used - slot->name && !memcmp(names + slot->name, name, len))
+		return 0;
+	// keep the table at most half full, so that probes stay short
+	if ((!slot->hash && si->used >= si->nslots / 2) ||
+	    si->names_used + len + 1 > si->names_size)
+		return -1;
+
+	// The name is written before any slot points at it.
+	off = si->names_used;
+	memcpy(names + off, name, len);
+	names[off + len] = '\0';
+	si->names_used += len + 1;
+	si->shm->names_used = si->names_used;
+
+	if (!slot->hash)
+		si->used++;
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&slot->layer, layer, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->name, off, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Publishes the winning name of every layer in idx, the index of the
+ * directory dir[0..dlen) as requested. When the segment fills up it is
+ * cleared, so it holds the most recently built indexes.
+ */
+static void shm_publish(struct shm_index *si, const char *dir, size_t dlen,
+			const struct dindex *idx)
+{
+	struct dindex_match m;
+	uint64_t h = path_hash64(dir, dlen), hash;
+	unsigned int i, k;
+	size_t len;
+
+	pthread_mutex_lock(&si->lock);
+	for (i = 0; i < dindex_size(idx); i++)
+	{
+		if (!dindex_entry(idx, i, &m))
+			continue;
+		for (k = 0; k < m.count; k++)
+		{
+			len = strlen(m.name[k]);
+			hash = fuzzyfs_hash_join(hash_key, h, fuzzyfs_hash_name(hash_key, m.name[k], len));
+			if (shm_put(si, hash, m.layer[k], m.name[k], len) == -1)
+			{
+				shm_clear(si);
+				shm_put(si, hash, m.layer[k], m.name[k], len);
+			}
+		}
+	}
+	pthread_mutex_unlock(&si->lock);
+}
+
+/*
+ * Creates the segment called name for tree t, readable by our user only
+ * since its key is what keeps hashes from being made to collide. One
+ * left over by a previous run is replaced, not reused: anyone could
+ * have created it. Returns NULL after printing an error.
+ */
+static struct shm_index *shm_create(struct tree *t, const char *name)
+{
+	struct shm_index *si;
+	struct fuzzyfs_shm *shm;
+	size_t size = (size_t)conf.shm_size << 20, off;
+	uint32_t nslots;
+	unsigned int l;
+	int fd;
+
+	if (size < (1 << 20))
+		size = 1 << 20;
+	if (size > UINT32_MAX)
+		size = UINT32_MAX;
+
+	if ((shm_unlink(name) == -1 && errno != ENOENT) ||
+	    (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+	{
+		perror(name);
+		return NULL;
+	}
+	if (ftruncate(fd, size) == -1 ||
+	    (shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		perror(name);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	if (!(si = calloc(1, sizeof(*si))))
+	{
+		perror(name);
+		munmap(shm, size);
+		return NULL;
+	}
+	pthread_mutex_init(&si->lock, NULL);
+	si->shm = shm;
+
+	// new and zeroed, so readers see nothing until it is filled in
+	__atomic_store_n(&shm->seq, 1, __ATOMIC_RELEASE);
+
+	off = sizeof(*shm);
+	shm->layers = off;
+	for (l = 0; l < t->nlayers; l++)
+	{
+		strcpy((char*)shm + off, t->layers[l].path);
+		off += strlen(t->layers[l].path) + 1;
+	}
+	shm->nlayers = t->nlayers;
+
+	// half of the segment for slots, the rest for names
+	for (nslots = 1024; (size_t)nslots * 2 * sizeof(struct fuzzyfs_shm_slot) <= size / 2; nslots <<= 1)
+		;
+	off = (off + 63) & ~(size_t)63;
+	shm->slots = off;
+	shm->nslots = si->nslots = nslots;
+	si->slots = (struct fuzzyfs_shm_slot*)((char*)shm + off);
+	off += nslots * sizeof(struct fuzzyfs_shm_slot);
+	shm->names = off;
+	si->names = (char*)shm + off;
+	shm->names_size = si->names_size = size - off;
+	shm->names_used = si->names_used = 0;
+	shm->key[0] = hash_key[0];
+	shm->key[1] = hash_key[1];
+	shm->magic = FUZZYFS_SHM_MAGIC;
+	shm->version = FUZZYFS_SHM_VERSION;
+	__atomic_store_n(&shm->seq, 2, __ATOMIC_RELEASE);
+	return si;
+}
+
+// Tells whether idx still describes the directory at real[l][0..len) of w.
+static int dindex_valid(struct dindex *idx, struct walk *w, size_t len)
+{
+	struct stat s;
+	const char *rel;
+	unsigned int l;
+	int res, fd;
+	char c;
+
+	if (idx->layers != w->live)
+		return FALSE;
+
+	for (l = 0; l < w->t->nlayers; l++)
+	{
+		if (!(w->live & (1u << l)))
+			continue;
+		fd = walk_at(w, l, len, &rel);
+		c = w->real[l][len];
+		w->real[l][len] = '\0';
+		res = fstatat(fd, rel, &s, 0);
+		w->real[l][len] = c;
+		if (res == -1 || s.st_ino != idx->part[l]->ino ||
+		    s.st_mtim.tv_sec != idx->part[l]->mtime.tv_sec ||
+		    s.st_mtim.tv_nsec != idx->part[l]->mtime.tv_nsec)
+			return FALSE;
+	}
+	__atomic_store_n(&idx->checked, now(), __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/*
+ * Applies the index match m for the component at [start, end) to the
+ * layers in miss: each gets its own real spelling, or stops being live
+ * if the merged directory has no such name in that layer.
+ */
+static void walk_apply(struct walk *w, const struct dindex_match *m, unsigned int miss,
+		       size_t start, size_t end)
+{
+	unsigned int l, k;
+
+	for (l = 0; l < w->t->nlayers; l++)
+	{
+		if (!(miss & (1u << l)))
+			continue;
+		for (k = 0; k < m->count && m->layer[k] != l; k++)
+			;
+		if (k < m->count)
+		{
+			log_msg(LOG_DEBUG, "%.*s --> %s\n", (int)(end - start), w->real[l] + start,
+				m->name[k]);
+			memcpy(w->real[l] + start, m->name[k], end - start);
+		}
+		else
+			w->live &= ~(1u << l);
+	}
+}
+
+/*
+ * With conf.cache_timeout_max, directories that have not been seen to
+ * change for a while are trusted without checking for longer than
+ * conf.cache_timeout: a tenth of the time since, up to that many seconds,
+ * as NFS clients do with attributes. Watches and cached data found stale
+ * tell of changes.
+ */
+#define ADAPT_DIVISOR 10
+
+/*
+ * Fills in *pol with the policy of n, finding it again if the rules
+ * changed since. Called with dc->lock held.
+ */
+static void dnode_policy(struct tree *t, struct dnode *n, struct policy *pol)
+{
+	unsigned int epoch = __atomic_load_n(&policy_epoch, __ATOMIC_ACQUIRE), ttl, max;
+
+	if (n->epoch != epoch)
+	{
+		policy_get(t, n->path[0] ? n->path : DOT, &n->policy);
+		n->epoch = epoch;
+	}
+	*pol = n->policy;
+
+	max = TUNABLE(cache_timeout_max);
+	if (max && !(pol->flags & (POLICY_TTL | POLICY_FROZEN | POLICY_NOCACHE)))
+	{
+		ttl = (now() - n->changed) / ADAPT_DIVISOR;
+		if (ttl > max)
+			ttl = max;
+		if (ttl > TUNABLE(cache_timeout))
+		{
+			pol->flags |= POLICY_TTL;
+			pol->ttl = ttl;
+		}
+	}
+}
+
+/*
+ * Finds the policy of the directory path[0..len) containing the requested
+ * path, hash being its path_hash(), through its node, so that the rules
+ * are only walked once per directory.
+ */
+static void dir_policy(struct tree *t, const char *path, size_t len, unsigned int hash,
+		       struct policy *pol)
+{
+	struct dcache *dc = &t->dcache;
+	struct dnode *n;
+
+	if (!__atomic_load_n(&policy_any, __ATOMIC_RELAXED) && !TUNABLE(cache_timeout_max))
+	{
+		pol->flags = 0;
+		pol->ttl = 0;
+		return;
+	}
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, path, len, hash)) != NULL)
+		dnode_policy(t, n, pol);
+	pthread_mutex_unlock(&dc->lock);
+	if (!n)
+		policy_get(t, path, pol);
+}
+
+// Finds the policy of the directory containing the requested path, tokenized as ts.
+static void parent_policy(struct tree *t, const char *path, const struct tokens *ts,
+			  struct policy *pol)
+{
+	size_t n = ts->count;
+
+	if (n > 1)
+		dir_policy(t, path, ts->tk[n - 2].end, ts->tk[n - 2].prefix, pol);
+	else
+		dir_policy(t, path, 0, 0, pol);
+}
+
+/*
+ * Notes that the directory containing the requested path, tokenized as
+ * ts, was seen to change.
+ */
+static void dir_changed(struct tree *t, const char *path, const struct tokens *ts)
+{
+	struct dcache *dc = &t->dcache;
+	struct dnode *n;
+	size_t i = ts->count;
+
+	pthread_mutex_lock(&dc->lock);
+	if (i > 1)
+		n = dcache_lookup(dc, path, ts->tk[i - 2].end, ts->tk[i - 2].prefix);
+	else
+		n = dcache_lookup(dc, path, 0, 0);
+	if (n)
+		n->changed = now();
+	pthread_mutex_unlock(&dc->lock);
+}
+
+// Allocates an open directory requested as path[0..len), in no layer yet.
+static struct dopen *dopen_alloc(struct tree *t, const char *path, size_t len)
+{
+	struct dopen *o;
+	unsigned int l;
+
+	if (!(o = calloc(1, sizeof(*o) + (t->nlayers + 1) * (len + 1))))
+		return NULL;
+	memcpy(o->path, path, len);
+	for (l = 0; l < t->nlayers; l++)
+	{
+		o->real[l] = o->path + (l + 1) * (len + 1);
+		memcpy(o->real[l], path, len);
+	}
+	o->checked = now();
+	return o;
+}
+
+/*
+ * Tells whether the real paths of o still lead to the directories it
+ * has open, under the policy pol of its node.
+ */
+static int dopen_valid(struct tree *t, struct dopen *o, const struct policy *pol)
+{
+	struct stat s;
+	unsigned int l;
+
+	if (policy_fresh(pol, __atomic_load_n(&o->checked, __ATOMIC_RELAXED)))
+		return TRUE;
+	for (l = 0; l < t->nlayers; l++)
+	{
+		if (!(o->live & (1u << l)))
+			continue;
+		if (fstatat(t->layers[l].fd, o->real[l][0] ? o->real[l] : DOT, &s, 0) == -1 ||
+		    s.st_ino != o->ino[l])
+			return FALSE;
+	}
+	__atomic_store_n(&o->checked, now(), __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+// Stops keeping o as the open directory of its node, since it went stale.
+static void dopen_forget(struct tree *t, struct dopen *o)
+{
+	struct dcache *dc = &t->dcache;
+	struct dnode *n;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_find(dc, o->path)) != NULL && n->open == o)
+		dnode_close(dc, n);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/*
+ * Finds the deepest open directory among the requested path, tokenized
+ * as ts, and its parents, whose policy trusts it for a while, and sets
+ * *count to the number of components it covers. Returns it with a
+ * reference for the caller if it is still current, or NULL.
+ */
+static struct dopen *dopen_find(struct tree *t, const char *path, const struct tokens *ts,
+				size_t *count)
+{
+	struct dcache *dc = &t->dcache;
+	struct dopen *o = NULL;
+	struct policy pol;
+	struct dnode *n;
+	size_t i;
+
+	*count = 0;
+	if (!__atomic_load_n(&dc->opened, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&dc->lock);
+	for (i = ts->count; i && !o; i--)
+	{
+		n = dcache_lookup(dc, path, ts->tk[i - 1].end, ts->tk[i - 1].prefix);
+		if (!n || !n->open)
+			continue;
+		// checking one never trusted would walk as much as it saves
+		dnode_policy(t, n, &pol);
+		if (!policy_trusts(&pol))
+			continue;
+		o = n->open;
+		__atomic_add_fetch(&o->refs, 1, __ATOMIC_RELAXED);
+		dcache_touch(dc, n);
+		*count = i;
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	// The stats must not happen under the lock.
+	if (o && !dopen_valid(t, o, &pol))
+	{
+		dopen_forget(t, o);
+		dopen_put(o);
+		o = NULL;
+		*count = 0;
+	}
+	return o;
+}
+
+/*
+ * Finds the open directory containing path, if there is one that can
+ * be trusted without checking. Returns it with a reference for the
+ * caller, or NULL.
+ */
+static struct dopen *dopen_parent(struct tree *t, const char *path)
+{
+	struct dcache *dc = &t->dcache;
+	struct dopen *o = NULL;
+	const char *slash = strrchr(path, '/');
+	size_t len = slash ? (size_t)(slash - path) : 0;
+	struct policy pol;
+	struct dnode *n;
+
+	if (!len || !__atomic_load_n(&dc->opened, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_mutex_lock(&dc->lock);
+	n = dcache_lookup(dc, path, len, path_hash(path, len));
+	if (n && (o = n->open) != NULL)
+	{
+		dnode_policy(t, n, &pol);
+		if (policy_fresh(&pol, __atomic_load_n(&o->checked, __ATOMIC_RELAXED)))
+		{
+			__atomic_add_fetch(&o->refs, 1, __ATOMIC_RELAXED);
+			dcache_touch(dc, n);
+		}
+		else
+			o = NULL;
+	}
+	pthread_mutex_unlock(&dc->lock);
+	return o;
+}
+
+/*
+ * Returns the descriptor real, a path in layer l, is to be reached
+ * from, pointing *rel at it relative to that: the directory o if it
+ * is real's, the layer's root otherwise.
+ */
+static int dopen_at(struct tree *t, struct dopen *o, unsigned int l,
+		    const char *real, const char **rel)
+{
+	size_t len = o ? strlen(o->path) : 0;
+
+	if (len && o->live & (1u << l) && !strncmp(o->real[l], real, len) && real[len] == '/')
+	{
+		*rel = real + len + 1;
+		return o->fd[l];
+	}
+	*rel = real;
+	return t->layers[l].fd;
+}
+
+/*
+ * Drops the index of the directory a watch is on, and everything else
+ * cached about it. If the watch is gone, the directory is not watched
+ * any more.
+ */
+static void watch_changed(struct dcache *dc, const char *dir, unsigned int gone)
+{
+	struct dnode *n;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_find(dc, dir)) != NULL)
+	{
+		n->gen = ++dc->gen;
+		n->changed = now();
+		if (gone)
+			n->watched = FALSE;
+		dnode_drop(n);
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+// Events were lost: nothing cached can be trusted without checking any more.
+static void watch_overflow(void)
+{
+	struct dnode *n;
+	struct tree *t;
+
+	for (t = trees; t; t = t->next)
+	{
+		pthread_mutex_lock(&t->dcache.lock);
+		for (n = t->dcache.lru.lru_next; n != &t->dcache.lru; n = n->lru_next)
+		{
+			n->gen = ++t->dcache.gen;
+			if (n->watched)
+				dnode_drop(n);
+		}
+		pthread_mutex_unlock(&t->dcache.lock);
+	}
+}
+
+static void *watch_thread(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct watch *e, *next, *found, *c;
+	unsigned int gone;
+	ssize_t len;
+	char *p;
+
+	(void) arg;
+
+	for (;;)
+	{
+		if ((len = read(watcher.fd, buf, sizeof(buf))) <= 0)
+		{
+			if (len == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len)
+		{
+			ev = (const struct inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				watch_overflow();
+				continue;
+			}
+
+			// Copies, since the nodes are only reached without the lock.
+			found = NULL;
+			pthread_mutex_lock(&watcher.lock);
+			for (e = watcher.table[ev->wd % WATCH_BUCKETS]; e; e = next)
+			{
+				next = e->next;
+				if (e->wd != ev->wd)
+					continue;
+				if (ev->mask & IN_IGNORED)
+				{
+					watch_unlink(e);
+					c = e;
+				}
+				else if ((c = malloc(sizeof(*c) + strlen(e->dir) + 1)) != NULL)
+				{
+					c->dc = e->dc;
+					strcpy(c->dir, e->dir);
+				}
+				else
+				{
+					// nothing is to be trusted without the event
+					c = NULL;
+					pthread_mutex_unlock(&watcher.lock);
+					watch_overflow();
+					pthread_mutex_lock(&watcher.lock);
+					break;
+				}
+				c->next = found;
+				found = c;
+			}
+			pthread_mutex_unlock(&watcher.lock);
+
+			// a watch that moved or went away is not on dir any more
+			gone = ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF);
+			for (c = found; c; c = next)
+			{
+				next = c->next;
+				watch_changed(c->dc, c->dir, gone);
+				free(c);
+			}
+		}
+	}
+	log_msg(LOG_ERR, "fuzzyfs: inotify: %s\n", strerror(errno));
+	return NULL;
+}
+
+static void watch_init(void)
+{
+	pthread_t th;
+
+	if ((watcher.fd = inotify_init1(IN_CLOEXEC)) == -1)
+	{
+		log_msg(LOG_WARNING, "fuzzyfs: inotify: %s\n", strerror(errno));
+		return;
+	}
+	if (pthread_create(&th, NULL, watch_thread, NULL) == 0)
+		pthread_detach(th);
+}
+
+/*
+ * Watches the directory at real[l][0..len) of every live layer of w,
+ * requested as dir. Returns FALSE if some layer could not be watched.
+ */
+static int watch_add(struct walk *w, const char *dir, size_t len)
+{
+	struct dcache *dc = &w->t->dcache;
+	struct watch *e, *n;
+	char *path;
+	unsigned int l, hash = path_hash(dir, len);
+	int wd, res = TRUE;
+
+	pthread_once(&watcher.once, watch_init);
+	if (watcher.fd == -1)
+		return FALSE;
+
+	for (l = 0; l < w->t->nlayers; l++)
+	{
+		if (!(w->live & (1u << l)))
+			continue;
+		if (asprintf(&path, "%s/%.*s", w->t->layers[l].path, (int)len, w->real[l]) == -1)
+			return FALSE;
+		wd = inotify_add_watch(watcher.fd, path, WATCH_EVENTS);
+		free(path);
+		if (wd == -1)
+		{
+			res = FALSE;
+			continue;
+		}
+
+		pthread_mutex_lock(&watcher.lock);
+		for (e = watcher.dirs[hash % WATCH_BUCKETS]; e; e = e->dir_next)
+			if (e->wd == wd && e->dc == dc && e->hash == hash &&
+			    !strncmp(e->dir, dir, len) && !e->dir[len])
+				break;
+		if (!e && (n = malloc(sizeof(*n) + len + 1)) != NULL)
+		{
+			n->wd = wd;
+			n->dc = dc;
+			n->hash = hash;
+			memcpy(n->dir, dir, len);
+			n->dir[len] = '\0';
+			n->next = watcher.table[wd % WATCH_BUCKETS];
+			watcher.table[wd % WATCH_BUCKETS] = n;
+			n->dir_next = watcher.dirs[hash % WATCH_BUCKETS];
+			watcher.dirs[hash % WATCH_BUCKETS] = n;
+			watcher.count++;
+		}
+		else if (!e)
+		{
+			// events could not be told apart: don't rely on them
+			if (!watch_used(wd))
+				inotify_rm_watch(watcher.fd, wd);
+			res = FALSE;
+		}
+		pthread_mutex_unlock(&watcher.lock);
+	}
+	return res;
+}
+
+/*
+ * Indexes the directory requested as dir[0..len) (whose real paths are in
+ * w, and whose path_hash() is hash), as its policy says, publishing the
+ * index and keeping the memory budget. Returns the index with a reference
+ * for the caller, or NULL with errno set if the directory can't be read,
+ * or 0 if it is not to be indexed.
+ */
+static struct dindex *dnode_build(struct walk *w, const char *dir, size_t len,
+				  unsigned int hash)
+{
+	struct tree *t = w->t;
+	struct dcache *dc = &t->dcache;
+	struct dindex *idx, *old = NULL;
+	struct policy pol = { 0, 0 };
+	struct dnode *n;
+	unsigned int gen = 0;
+	int watched = FALSE;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, dir, len, hash)) != NULL)
+	{
+		dnode_policy(t, n, &pol);
+		gen = n->gen;
+	}
+	pthread_mutex_unlock(&dc->lock);
+	if (pol.flags & POLICY_NOCACHE)
+	{
+		errno = 0;
+		return NULL;
+	}
+
+	// watch first, so that no change can go unnoticed
+	if (pol.flags & POLICY_WATCHED)
+		watched = watch_add(w, dir, len);
+	if (!(idx = dindex_build(w, len, pol.flags)))
+		return NULL;
+	idx->gen = gen;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, dir, len, hash)) != NULL)
+	{
+		if (pol.flags & POLICY_WATCHED)
+			n->watched = watched;
+		old = n->index;
+		n->index = idx;
+		dindex_get(idx);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	if (old)
+		dindex_put(old);
+	if (t->shm)
+		shm_publish(t->shm, dir, len, idx);
+	if (TUNABLE(cache_mem) &&
+	    __atomic_load_n(&mem_used, __ATOMIC_RELAXED) > (size_t)TUNABLE(cache_mem) << 20)
+		mem_reclaim();
+	return idx;
+}
+
+/*
+ * Returns the index of the directory requested as dir[0..len) (whose real
+ * paths are in w, and whose path_hash() is hash) with a reference for the
+ * caller, if it has a current one, and fills in *pol with its policy.
+ */
+static struct dindex *dnode_index(struct walk *w, const char *dir, size_t len,
+				  unsigned int hash, struct policy *pol)
+{
+	struct dcache *dc = &w->t->dcache;
+	struct dindex *idx = NULL;
+	struct dnode *n;
+	unsigned int gen = 0;
+	int watched = FALSE;
+
+	pol->flags = 0;
+	pol->ttl = 0;
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, dir, len, hash)) != NULL)
+	{
+		dnode_policy(w->t, n, pol);
+		gen = n->gen;
+		watched = n->watched && pol->flags & POLICY_WATCHED;
+		if ((idx = n->index) != NULL && !(pol->flags & POLICY_NOCACHE))
+			dindex_get(idx);
+		else
+			idx = NULL;
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	// The stats must not happen under the lock.
+	if (idx && (idx->gen != gen || idx->layers != w->live ||
+		    (!watched && !policy_fresh(pol, __atomic_load_n(&idx->checked, __ATOMIC_RELAXED)) &&
+		     !dindex_valid(idx, w, len))))
+	{
+		pthread_mutex_lock(&dc->lock);
+		if ((n = dcache_get(dc, dir, len, hash)) != NULL && n->index == idx)
+		{
+			n->index = NULL;
+			n->changed = now();
+			dindex_put(idx);
+		}
+		pthread_mutex_unlock(&dc->lock);
+		dindex_put(idx);
+		idx = NULL;
+	}
+	return idx;
+}
+
+/*
+ * Filters take about 10 bits and 7 probes per name, for roughly 1% of
+ * false positives. The probes are derived from the name_hash().
+ */
+#define FILTER_BITS	10
+#define FILTER_PROBES	7
+
+static void dfilter_add(struct dfilter *f, unsigned int hash)
+{
+	unsigned int step = ((hash >> 16) | (hash << 16)) * 0x9e3779b1u | 1, i;
+
+	for (i = 0; i < FILTER_PROBES; i++, hash += step)
+		f->bits[(hash & f->mask) / 64] |= (uint64_t)1 << (hash & 63);
+}
+
+// Tells whether a name hashing to hash may be in f.
+static int dfilter_test(const struct dfilter *f, unsigned int hash)
+{
+	unsigned int step = ((hash >> 16) | (hash << 16)) * 0x9e3779b1u | 1, i;
+
+	for (i = 0; i < FILTER_PROBES; i++, hash += step)
+		if (!(f->bits[(hash & f->mask) / 64] & (uint64_t)1 << (hash & 63)))
+			return FALSE;
+	return TRUE;
+}
+
+/*
+ * Builds the filter of the count names hashing to hashes, read from a
+ * directory that was s before reading it. Returns NULL if out of memory.
+ */
+static struct dfilter *dfilter_build(const unsigned int *hashes, size_t count,
+				     const struct stat *s)
+{
+	struct dfilter *f;
+	size_t bits, i;
+
+	for (bits = 64; bits < count * FILTER_BITS && bits < (size_t)1 << 32; bits <<= 1)
+		;
+	if (!(f = calloc(1, sizeof(*f) + bits / 8)))
+		return NULL;
+	f->refs = 1;
+	f->bytes = sizeof(*f) + bits / 8;
+	f->checked = now();
+	f->mtime = s->st_mtim;
+	f->ino = s->st_ino;
+	f->mask = bits - 1;
+	for (i = 0; i < count; i++)
+		dfilter_add(f, hashes[i]);
+	__atomic_add_fetch(&mem_used, f->bytes, __ATOMIC_RELAXED);
+	return f;
+}
+
+// Tells whether f still describes the directory at real[l][0..len) of w.
+static int dfilter_valid(struct dfilter *f, struct walk *w, unsigned int l, size_t len,
+			 const struct policy *pol)
+{
+	struct stat s;
+	const char *rel;
+	int res, fd;
+	char c;
+
+	if (policy_fresh(pol, __atomic_load_n(&f->checked, __ATOMIC_RELAXED)))
+		return TRUE;
+	fd = walk_at(w, l, len, &rel);
+	c = w->real[l][len];
+	w->real[l][len] = '\0';
+	res = fstatat(fd, rel, &s, 0);
+	w->real[l][len] = c;
+	if (res == -1 || s.st_ino != f->ino || s.st_mtim.tv_sec != f->mtime.tv_sec ||
+	    s.st_mtim.tv_nsec != f->mtime.tv_nsec)
+		return FALSE;
+	__atomic_store_n(&f->checked, now(), __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/*
+ * Makes f the filter of layer l of the directory requested as
+ * dir[0..len), whose path_hash() is hash, if old still is. Takes over
+ * the reference to f. A NULL f means old went stale.
+ */
+static void dnode_set_filter(struct tree *t, const char *dir, size_t len, unsigned int hash,
+			     unsigned int l, struct dfilter *old, struct dfilter *f)
+{
+	struct dcache *dc = &t->dcache;
+	struct dnode *n;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, dir, len, hash)) != NULL &&
+	    (n->filters & (1u << l) ? n->filter[l] : NULL) == old)
+	{
+		if (old)
+			dfilter_put(old);
+		if (!f)
+			n->changed = now();
+		n->filter[l] = f;
+		n->filters = f ? n->filters | (1u << l) : n->filters & ~(1u << l);
+		f = NULL;
+	}
+	pthread_mutex_unlock(&dc->lock);
+	if (f)
+		dfilter_put(f);
+	if (TUNABLE(cache_mem) &&
+	    __atomic_load_n(&mem_used, __ATOMIC_RELAXED) > (size_t)TUNABLE(cache_mem) << 20)
+		mem_reclaim();
+}
+
+/*
+ * Corrects the case of the component tk of the requested path p in each
+ * layer in miss, i.e. those where it does not exist with the requested
+ * case, p[0..dlen) being its directory and dhash the path_hash() of
+ * that. Uses the merged directory index if there is one and it is still
+ * current, otherwise scans the directory in each of those layers,
+ * building an index instead once the directory has missed
+ * conf.index_threshold times.
+ * Directories of at least conf.filter_min entries get a filter of their
+ * names when scanned, and are left to it rather than indexed: names it
+ * rules out are not scanned for.
+ * Layers without a match, or whose directory can't be read, are removed
+ * from w->live.
+ */
+static void dir_lookup(struct walk *w, const char *p, size_t dlen, unsigned int dhash,
+		       const struct token *tk, unsigned int miss)
+{
+	struct dnode *n;
+	struct dindex *idx = NULL;
+	struct dfilter *filter[MAX_LAYERS], *f;
+	struct dindex_match m;
+	struct dirent *de;
+	struct stat s;
+	const char *name = p + tk->start;
+	size_t nlen = tk->end - tk->start, count, size = 0;
+	unsigned int l, threshold, filters = 0, filter_min, *hashes = NULL, *h;
+	struct policy pol;
+	char best[NAME_MAX + 1];
+	int build, must, valid, rejected, stated, turn;
+	DIR *dp;
+	struct dcache *dc = &w->t->dcache;
+
+	idx = dnode_index(w, p, dlen, dhash, &pol);
+
+	/*
+	 * Frozen and watched directories are cheap to keep, index them right
+	 * away. So are all of them when the collision setting needs an index
+	 * for every lookup.
+	 */
+	if (!idx && !(pol.flags & POLICY_NOCACHE))
+	{
+		must = pol.flags & (POLICY_FROZEN | POLICY_WATCHED) || collision != COLLISION_EXACT;
+		threshold = must ? 1 : TUNABLE(index_threshold);
+		pthread_mutex_lock(&dc->lock);
+		n = dcache_get(dc, p, dlen, dhash);
+		build = n && threshold && ++n->misses >= threshold && (must || !n->filters);
+		for (l = 0; n && !build && l < w->t->nlayers; l++)
+		{
+			if (miss & n->filters & (1u << l))
+			{
+				filter[l] = n->filter[l];
+				__atomic_add_fetch(&filter[l]->refs, 1, __ATOMIC_RELAXED);
+				filters |= 1u << l;
+			}
+		}
+		pthread_mutex_unlock(&dc->lock);
+
+		if (build)
+			idx = dnode_build(w, p, dlen, dhash);
+	}
+
+	if (idx)
+	{
+		STAT_INC(w->t, index_hits);
+		if (dindex_lookup(idx, name, nlen, tk->hash, &m))
+			walk_apply(w, &m, miss, tk->start, tk->end);
+		else
+			w->live &= ~miss;
+		dindex_put(idx);
+		return;
+	}
+
+	filter_min = pol.flags & POLICY_NOCACHE ? 0 : TUNABLE(filter_min);
+	for (l = 0; l < w->t->nlayers; l++)
+	{
+		if (!(miss & (1u << l)))
+			continue;
+
+		w->live &= ~(1u << l);
+		valid = FALSE;
+		if (filters & (1u << l))
+		{
+			f = filter[l];
+			valid = dfilter_valid(f, w, l, dlen, &pol);
+			rejected = valid && !dfilter_test(f, tk->hash);
+			if (!valid)
+				dnode_set_filter(w->t, p, dlen, dhash, l, f, NULL);
+			dfilter_put(f);
+			if (rejected)
+			{
+				STAT_INC(w->t, filter_hits);
+				continue;
+			}
+		}
+		if (!(dp = walk_opendir(w, l, dlen)))
+			continue;
+		STAT_INC(w->t, scans);
+		stated = !fstat(dirfd(dp), &s);
+		turn = resolve_enter(stated ? s.st_size : 0);
+
+		// the names are hashed for a filter only if there is none yet
+		count = 0;
+		if (valid || !filter_min || !stated)
+			size = 0;
+		else if (!size)
+			size = 1024;
+
+		/*
+		 * Note: don't free de. It's managed separately.
+		 * Under COLLISION_EXACT the first match wins, so the rest is only
+		 * read for a filter. Otherwise read it all, the winner must not
+		 * depend on the readdir() order.
+		 */
+		while ((de = readdir(dp)) != NULL)
+		{
+			if (strncasecmp(de->d_name, name, nlen) == 0 && !de->d_name[nlen] &&
+			    (!(w->live & (1u << l)) || collision_better(dirfd(dp), de->d_name, best)))
+			{
+				strcpy(best, de->d_name);
+				w->live |= 1u << l;
+			}
+			if (!size)
+			{
+				if (collision == COLLISION_EXACT && w->live & (1u << l))
+					break;
+				continue;
+			}
+			if (!hashes || count == size)
+			{
+				if (hashes)
+					size *= 2;
+				if (!(h = realloc(hashes, size * sizeof(*hashes))))
+				{
+					size = 0;
+					continue;
+				}
+				hashes = h;
+			}
+			hashes[count++] = name_hash(de->d_name, strlen(de->d_name));
+		}
+		if (w->live & (1u << l))
+		{
+			log_msg(LOG_DEBUG, "%.*s --> %s\n", (int)nlen, name, best);
+			memcpy(w->real[l] + tk->start, best, nlen);
+		}
+		closedir(dp);
+		resolve_leave(turn);
+
+		if (size && count >= filter_min && (f = dfilter_build(hashes, count, &s)) != NULL)
+			dnode_set_filter(w->t, p, dlen, dhash, l, NULL, f);
+	}
+	free(hashes);
+}
+
+/*
+ * Keeps the directory requested as path[0..len) (whose path_hash() is
+ * hash), which the walk w went through in the layers live, open for the
+ * lookups to come, unless it already is or its policy says not to cache.
+ */
+static void dopen_cache(struct walk *w, const char *path, size_t len, unsigned int hash,
+			unsigned int live)
+{
+	struct tree *t = w->t;
+	struct dcache *dc = &t->dcache;
+	struct policy pol;
+	struct dopen *o;
+	struct dnode *n;
+	struct stat s;
+	const char *rel;
+	unsigned int l;
+	int fd, skip;
+	char c;
+
+	if (!TUNABLE(dir_fds))
+		return;
+	pthread_mutex_lock(&dc->lock);
+	if (!(skip = !(n = dcache_get(dc, path, len, hash)) || n->open))
+	{
+		dnode_policy(t, n, &pol);
+		skip = pol.flags & POLICY_NOCACHE || !policy_trusts(&pol);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	if (skip || !(o = dopen_alloc(t, path, len)))
+		return;
+	pthread_once(&nofile_once, nofile_raise);
+
+	for (l = 0; l < t->nlayers; l++)
+	{
+		if (!(live & (1u << l)))
+			continue;
+		memcpy(o->real[l], w->real[l], len);
+		fd = walk_at(w, l, len, &rel);
+		c = w->real[l][len];
+		w->real[l][len] = '\0';
+		o->fd[l] = openat(fd, rel, O_PATH | O_DIRECTORY);
+		w->real[l][len] = c;
+		if (o->fd[l] == -1)
+			continue;
+		if (fstat(o->fd[l], &s) == -1)
+		{
+			close(o->fd[l]);
+			continue;
+		}
+		o->live |= 1u << l;
+		o->ino[l] = s.st_ino;
+	}
+	if (!o->live)
+	{
+		free(o);
+		return;
+	}
+	o->refs = 1;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, path, len, hash)) != NULL && !n->open)
+		dnode_open(dc, n, o);
+	pthread_mutex_unlock(&dc->lock);
+	dopen_put(o);
+	if (__atomic_load_n(&dir_fds_used, __ATOMIC_RELAXED) > dir_fds_limit())
+		dir_fds_reclaim();
+}
+
+/*
+ * Resolves path, tokenized as ts, in every layer at once, filling in w.
+ * On success, the caller must free w->real[0], which holds all the
+ * per-layer copies. Returns FALSE if path exists in no layer.
+ */
+static int walk_tokens(struct tree *t, const char *path, const struct tokens *ts,
+		       struct walk *w)
+{
+	struct stat s;
+	const struct token *tk;
+	size_t len = strlen(path), dlen = 0, i;
+	const char *rel;
+	unsigned int l, miss, dhash = 0, dlive = 0;
+	int fd;
+	char *buf, c;
+
+	if (!(buf = malloc(t->nlayers * (len + 1))))
+		return FALSE;
+	w->t = t;
+	w->live = 0;
+	for (l = 0; l < t->nlayers; l++)
+	{
+		w->real[l] = buf + l * (len + 1);
+		memcpy(w->real[l], path, len + 1);
+		w->live |= 1u << l;
+	}
+
+	// what is under an open directory is resolved from there
+	w->base = 0;
+	if ((w->open = dopen_find(t, path, ts, &i)) != NULL)
+	{
+		w->base = strlen(w->open->path);
+		w->live = w->open->live;
+		for (l = 0; l < t->nlayers; l++)
+			if (w->live & (1u << l))
+				memcpy(w->real[l], w->open->real[l], w->base);
+	}
+
+	for (; w->live && i < ts->count; i++)
+	{
+		tk = &ts->tk[i];
+		dlen = i ? tk[-1].end : 0;
+		dhash = i ? tk[-1].prefix : 0;
+		dlive = w->live;
+
+		// If the current capitalization of the path (up to the current chunk) is incorrect
+		// in a layer (that is, if getting info about the currently-specified chunk returns
+		// a nonzero exit code), that layer needs the chunk corrected.
+		// Unless the case requested wins collisions, the directory always decides.
+		miss = collision == COLLISION_EXACT ? 0 : w->live;
+		for (l = 0; l < t->nlayers && collision == COLLISION_EXACT; l++)
+		{
+			if (!(w->live & (1u << l)))
+				continue;
+			fd = walk_at(w, l, tk->end, &rel);
+			c = w->real[l][tk->end];
+			w->real[l][tk->end] = '\0';
+			if (fstatat(fd, rel, &s, AT_SYMLINK_NOFOLLOW))
+				miss |= 1u << l;
+			w->real[l][tk->end] = c;
+		}
+		if (miss)
+			dir_lookup(w, path, dlen, dhash, tk, miss);
+	}
+	// the directory of what was looked up is likely to be needed again
+	if (w->live && dlen > w->base)
+		dopen_cache(w, path, dlen, dhash, dlive);
+	if (w->open)
+		dopen_put(w->open);
+	w->open = NULL;
+	w->base = 0;
+
+	if (!w->live)
+	{
+		free(buf);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// The same for a path not tokenized yet.
+static int walk_path_case(struct tree *t, const char *path, struct walk *w)
+{
+	struct tokens ts;
+	int res;
+
+	if (!tokenize(path, &ts))
+		return FALSE;
+	res = walk_tokens(t, path, &ts, w);
+	tokens_free(&ts);
+	return res;
+}
+
+/* Get the correct case for a file path by searching case-insenitively for matches.
+ * Input: path - a string holding the path that you want to correct the case of.
+ * This will iterate over slash-delimited chunks of path. On each iteration, it corrects
+ * the case of the current chunk (if correction is needed) by looking for files in the
+ * current chunk's parent directory (constructed from previous case-corrected chunks) that
+ * case-insensitively match the current chunk. If one is found, the current chunk is corrected.
+ * This repeats until the entire path is case-corrected.
+ * This is done for every layer at once; *layer is set to the highest priority layer in
+ * which the entire path exists, and the case-corrected path in that layer is returned.
+ *
+ * A note on memory management: this allocates new memory for the return value if it succeeds.
+ * If it fails, it will free all the memory that it allocated.
+*/
+char *fix_path_case(struct tree *t, const char *path, int *layer)
+{
+	struct tokens ts;
+	struct walk w;
+	struct stat s;
+	struct policy pol;
+	char *res = NULL;
+	int fresh, adapt;
+
+	STAT_INC(t, lookups);
+
+	// All the hashes needed are computed up front, in one pass.
+	if (!tokenize(path, &ts))
+		return NULL;
+
+	// A cached correction is only trusted if it still exists.
+	if ((res = pcache_lookup(&t->pcache, path, ts.hash, layer, &fresh)) != NULL)
+	{
+		if (fresh)
+		{
+			STAT_INC(t, cache_hits);
+			goto out;
+		}
+		if (!fstatat(t->layers[*layer].fd, res, &s, AT_SYMLINK_NOFOLLOW))
+		{
+			STAT_INC(t, cache_hits);
+			// its directory may be trusted for longer by now
+			if ((adapt = TUNABLE(cache_timeout_max) != 0))
+				parent_policy(t, path, &ts, &pol);
+			pcache_insert(&t->pcache, path, ts.hash, res, *layer, 0,
+				      adapt ? &pol : NULL, NULL);
+			goto out;
+		}
+		pcache_remove(&t->pcache, path, ts.hash);
+		dir_changed(t, path, &ts);
+		free(res);
+		res = NULL;
+	}
+
+	if (!walk_tokens(t, path, &ts, &w))
+		goto out;
+
+	*layer = __builtin_ctz(w.live);
+	res = strdup(w.real[*layer]);
+	free(w.real[0]);
+	if (res)
+	{
+		parent_policy(t, path, &ts, &pol);
+		pcache_insert(&t->pcache, path, ts.hash, res, *layer, 1, &pol,
+			      handle_get(t, *layer, res));
+	}
+out:
+	tokens_free(&ts);
+	return res;
+}
+
+/*
+ * Tells whether path, which exists with exactly the given case in layer
+ * l, resolves to another layer: one of higher priority that has it with
+ * another case, as a lookup of any other case would find it.
+ *
+ * The answer is remembered in the correction cache like any correction,
+ * and trusted like one: an entry in l was just seen to exist, and one in
+ * a higher layer is checked by the caller's fix_path_case(). Only
+ * paths not cached yet are walked, once.
+ */
+static int layer_shadowed(struct tree *t, const char *path, unsigned int l)
+{
+	char *p;
+	int layer, fresh;
+
+	if (!l)
+		return FALSE;
+	if ((p = pcache_lookup(&t->pcache, path, path_hash(path, strlen(path)), &layer, &fresh)) != NULL &&
+	    (unsigned int)layer <= l)
+	{
+		free(p);
+		return (unsigned int)layer < l;
+	}
+	free(p);
+	if (!(p = fix_path_case(t, path, &layer)))
+		return FALSE;
+	free(p);
+	return (unsigned int)layer < l;
+}
+
+/*
+ * Finds the highest priority layer in which path exists with exactly the
+ * given case, filling in st, unless a higher one has it with another
+ * case. Returns -1 with errno set if there is none; errno is ENOENT
+ * unless some layer failed for another reason, and the path is then to
+ * be corrected. If o, the open directory of path, has it, it is looked
+ * up from there.
+ */
+static int find_layer(struct tree *t, struct dopen *o, const char *path, struct stat *st)
+{
+	const char *rel;
+	unsigned int l;
+	int err = ENOENT, fd;
+
+	for (l = 0; l < t->nlayers; l++)
+	{
+		fd = dopen_at(t, o, l, path, &rel);
+		if (!fstatat(fd, rel, st, AT_SYMLINK_NOFOLLOW))
+		{
+			if (layer_shadowed(t, path, l))
+				break;
+			return l;
+		}
+		if (errno != ENOENT && err == ENOENT)
+			err = errno;
+	}
+	errno = err;
+	return -1;
+}
+
+struct warm_entry
+{
+	unsigned long hits;
+	char *path;
+};
+
+static int warm_entry_cmp(const void *a, const void *b)
+{
+	const struct warm_entry *x = a, *y = b;
+
+	if (x->hits != y->hits)
+		return x->hits < y->hits ? 1 : -1;
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Serializes warm_save(), which the periodic thread and an unmount may
+ * run at once, and which would then both write the same temporary file.
+ */
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Writes the requested paths in the correction cache of t to its warm file,
+ * hottest first, one "<hits> <path>" per line. The file is replaced
+ * atomically so a crash never leaves a truncated list behind.
+ * Hit counts are halved afterwards so that old traffic fades out.
+ */
+static void warm_save(struct tree *t)
+{
+	struct pcache *pc = &t->pcache;
+	struct warm_entry *list;
+	struct pcache_entry *e;
+	size_t n = 0, i;
+	char *tmp;
+	FILE *f;
+
+	pthread_mutex_lock(&pc->lock);
+	list = malloc((pc->count + 1) * sizeof(*list));
+	for (e = pc->lru.lru_next; list && e != &pc->lru; e = e->lru_next)
+	{
+		// the file is line based
+		if (strchr(e->path, '\n') || !(list[n].path = strdup(e->path)))
+			continue;
+		list[n++].hits = e->hits;
+		e->hits >>= 1;
+	}
+	pthread_mutex_unlock(&pc->lock);
+	if (!list)
+		return;
+
+	qsort(list, n, sizeof(*list), warm_entry_cmp);
+
+	if (asprintf(&tmp, "%s.tmp", t->warm_file) == -1)
+		tmp = NULL;
+	pthread_mutex_lock(&warm_lock);
+	if (tmp && (f = fopen(tmp, "w")) != NULL)
+	{
+		for (i = 0; i < n; i++)
+			fprintf(f, "%lu %s\n", list[i].hits, list[i].path);
+		if (fclose(f) == 0)
+			rename(tmp, t->warm_file);
+		else
+			unlink(tmp);
+	}
+	pthread_mutex_unlock(&warm_lock);
+	free(tmp);
+
+	for (i = 0; i < n; i++)
+		free(list[i].path);
+	free(list);
+}
+
+/*
+ * Resolves every path listed in the warm file of t, in file order (which
+ * is hottest first), so the correction cache is populated before traffic
+ * arrives. Paths that no longer resolve are simply dropped.
+ */
+static void warm_load(struct tree *t)
+{
+	FILE *f;
+	char *line = NULL, *path, *p;
+	size_t cap = 0;
+	ssize_t len;
+	unsigned long hits;
+	struct stat s;
+	int layer;
+
+	if (!(f = fopen(t->warm_file, "r")))
+		return;
+
+	while ((len = getline(&line, &cap, f)) > 0)
+	{
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		hits = strtoul(line, &path, 10);
+		if (*path++ != ' ' || !*path)
+			continue;
+
+		// Paths with the right case need no correction.
+		if (collision == COLLISION_EXACT && find_layer(t, NULL, path, &s) != -1)
+			continue;
+		if ((p = fix_path_case(t, path, &layer)) != NULL)
+		{
+			pcache_insert(&t->pcache, path, path_hash(path, strlen(path)), p, layer, hits, NULL, NULL);
+			free(p);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+// Warms the cache of tree arg from the previous run, then persists it periodically.
+static void *warm_thread(void *arg)
+{
+	struct tree *t = arg;
+
+	resolve_prio = RESOLVE_WARM;
+	warm_load(t);
+	for (;;)
+	{
+		sleep(TUNABLE(warm_interval));
+		warm_save(t);
+	}
+	return NULL;
+}
+
+// The tree of the mount the current request is for.
+static struct tree *cur_tree(void)
+{
+	return ((struct mount*)fuse_get_context()->private_data)->tree;
+}
+
+// Gets file attributes, correcting the path's capitalization if needed.
+static int fuzzyfs_getattr(const char *path, struct stat *stbuf)
+{
+	struct tree *t = cur_tree();
+	struct dopen *o;
+	const char *rel;
+	int res = -1, layer, err = ENOENT, fd;
+	char *p;
+
+	// files in a directory kept open are reached from it
+	p = (char*)fix_path(path);
+	o = p == DOT ? NULL : dopen_parent(t, p);
+	if (p == DOT || collision == COLLISION_EXACT)
+	{
+		res = find_layer(t, o, p, stbuf);
+		err = errno;
+	}
+
+	// Note: this allocates new memory for p, unless it returns an error.
+	if (res == -1 && err == ENOENT && (p = fix_path_case(t, p, &layer)) != NULL)
+	{
+		// A trusted correction may have gone away since it was checked.
+		fd = dopen_at(t, o, layer, p, &rel);
+		res = fstatat(fd, rel, stbuf, AT_SYMLINK_NOFOLLOW);
+		err = errno;
+		free(p);
+		p = NULL;
+	}
+	if (o)
+		dopen_put(o);
+	return res == -1 ? -err : 0;
+}
+
+/*
+ * A directory opened through fuzzyfs: the directory resolved in every
+ * layer, its stream in each of them, and with hide_duplicates its index,
+ * which tells which name of each set of case variants to list. Once a
+ * snapshot of the listing is taken, it is served instead and the streams
+ * are closed.
+ */
+struct dir_handle
+{
+	struct dopen *dir;
+	unsigned int count;
+	DIR *dp[MAX_LAYERS];
+	unsigned int layer[MAX_LAYERS];	// of each stream
+	struct dindex *index;
+	struct dlisting *listing;
+};
+
+/*
+ * Passes every entry of the streams of h to emit, which returns nonzero
+ * when it can take no more. With several layers, a name is only listed
+ * for the highest priority layer that has it, with any case, since
+ * lookups of it resolve to that one. With an index, names differing
+ * only in case are listed once, with the spelling lookups resolve to.
+ * Returns 0, or -ENOMEM if the entries passed are not all of them.
+ */
+static int dir_read(struct dir_handle *h,
+		    int (*emit)(void *ctx, const char *name, ino_t ino, unsigned char type),
+		    void *ctx)
+{
+	struct dirent *de;
+	struct dindex_match m;
+	unsigned int i, mask = 0, j;
+	uint64_t hash;
+	struct seen
+	{
+		char *name;
+		unsigned int stream;	// it came from
+	} *seen = NULL;
+	size_t count = 0;
+	int res = 0;
+
+	if (h->count > 1)
+	{
+		mask = 1023;
+		if (!(seen = calloc(mask + 1, sizeof(*seen))))
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < h->count; i++)
+	{
+		while ((de = readdir(h->dp[i])) != NULL)
+		{
+			size_t nlen = strlen(de->d_name);
+
+			// only the name lookups resolve to, of each set of case variants
+			hash = h->index || seen ? name_hash(de->d_name, nlen) : 0;
+			if (h->index && dindex_lookup(h->index, de->d_name, nlen, hash, &m))
+			{
+				if (m.layer[0] != h->layer[i] || strcmp(m.name[0], de->d_name))
+					continue;
+			}
+			else if (seen)
+			{
+				// case variants within a layer are all listed
+				for (j = hash & mask; seen[j].name; j = (j + 1) & mask)
+					if (seen[j].stream == i ? !strcmp(seen[j].name, de->d_name) :
+					    !strcasecmp(seen[j].name, de->d_name))
+						break;
+				if (seen[j].name)
+					continue;
+				if (!(seen[j].name = strdup(de->d_name)))
+				{
+					res = -ENOMEM;
+					goto out;
+				}
+				seen[j].stream = i;
+
+				// keep the set at most half full
+				if (++count > mask / 2)
+				{
+					struct seen *n = calloc((mask + 1) * 2, sizeof(*n));
+					unsigned int k;
+
+					if (!n)
+					{
+						res = -ENOMEM;
+						goto out;
+					}
+					mask = mask * 2 + 1;
+					for (k = 0; k <= mask / 2; k++)
+					{
+						if (!seen[k].name)
+							continue;
+						for (j = name_hash(seen[k].name, strlen(seen[k].name)) & mask; n[j].name;
+						     j = (j + 1) & mask)
+							;
+						n[j] = seen[k];
+					}
+					free(seen);
+					seen = n;
+				}
+			}
+
+			if (emit(ctx, de->d_name, de->d_ino, de->d_type))
+			{
+				res = -ENOMEM;
+				goto out;
+			}
+		}
+	}
+
+out:
+	if (seen)
+	{
+		for (j = 0; j <= mask; j++)
+			free(seen[j].name);
+		free(seen);
+	}
+	return res;
+}
+
+// A snapshot being taken.
+struct dlisting_builder
+{
+	struct dlisting *ls;
+	size_t used, cap;		// of names
+	unsigned int ecap;		// of ents
+	int failed;
+};
+
+// Appends an entry to the snapshot being taken in ctx.
+static int dlisting_add(void *ctx, const char *name, ino_t ino, unsigned char type)
+{
+	struct dlisting_builder *b = ctx;
+	struct dlisting *ls = b->ls;
+	size_t len = strlen(name) + 1;
+	void *n;
+
+	if (ls->count == b->ecap)
+	{
+		if (!(n = realloc(ls->ents, b->ecap * 2 * sizeof(*ls->ents))))
+			goto fail;
+		ls->ents = n;
+		b->ecap *= 2;
+	}
+	if (b->used + len > b->cap)
+	{
+		while (b->used + len > b->cap)
+			b->cap *= 2;
+		if (!(n = realloc(ls->names, b->cap)))
+			goto fail;
+		ls->names = n;
+	}
+	ls->ents[ls->count].ino = ino;
+	ls->ents[ls->count].type = type;
+	ls->ents[ls->count].name = b->used;
+	memcpy(ls->names + b->used, name, len);
+	b->used += len;
+	ls->count++;
+	return 0;
+
+fail:
+	b->failed = TRUE;
+	return -1;
+}
+
+/*
+ * Takes a snapshot of the listing of the streams of h, which have not
+ * been read yet. Returns NULL on failure.
+ */
+static struct dlisting *dlisting_take(struct dir_handle *h)
+{
+	struct dlisting_builder b = { NULL, 0, 1024, 64, FALSE };
+	struct dlisting *ls;
+	struct stat s;
+	unsigned int i;
+	char *n;
+
+	if (!(ls = b.ls = calloc(1, sizeof(*ls))) ||
+	    !(ls->ents = malloc(b.ecap * sizeof(*ls->ents))) ||
+	    !(ls->names = malloc(b.cap)))
+		goto fail;
+
+	// Stat before reading, so changes made during the read invalidate it.
+	for (i = 0; i < h->count; i++)
+	{
+		if (fstat(dirfd(h->dp[i]), &s) == -1)
+			goto fail;
+		ls->layers |= 1u << h->layer[i];
+		ls->stamp[h->layer[i]].mtime = s.st_mtim;
+		ls->stamp[h->layer[i]].ino = s.st_ino;
+	}
+
+	if (dir_read(h, dlisting_add, &b) || b.failed)
+		goto fail;
+	if (b.used && (n = realloc(ls->names, b.used)) != NULL)
+	{
+		ls->names = n;
+		b.cap = b.used;
+	}
+	ls->refs = 1;
+	ls->hidden = h->index != NULL;
+	ls->checked = now();
+	ls->bytes = sizeof(*ls) + b.cap + b.ecap * sizeof(*ls->ents);
+	__atomic_add_fetch(&mem_used, ls->bytes, __ATOMIC_RELAXED);
+	return ls;
+
+fail:
+	if (ls)
+	{
+		free(ls->ents);
+		free(ls->names);
+		free(ls);
+	}
+	return NULL;
+}
+
+/*
+ * Tells whether ls still lists the directory open as o, under the
+ * policy pol, its node being at generation gen and watched or not.
+ */
+static int dlisting_valid(struct dlisting *ls, struct dopen *o,
+			  const struct policy *pol, unsigned int gen, int watched)
+{
+	struct stat s;
+	unsigned int l;
+
+	if (ls->gen != gen || ls->layers != o->live ||
+	    ls->hidden != !!TUNABLE(hide_duplicates))
+		return FALSE;
+	if (watched || policy_fresh(pol, __atomic_load_n(&ls->checked, __ATOMIC_RELAXED)))
+		return TRUE;
+
+	for (l = 0; l < MAX_LAYERS; l++)
+	{
+		if (!(o->live & (1u << l)))
+			continue;
+		if (fstat(o->fd[l], &s) == -1 ||
+		    s.st_ino != ls->stamp[l].ino ||
+		    s.st_mtim.tv_sec != ls->stamp[l].mtime.tv_sec ||
+		    s.st_mtim.tv_nsec != ls->stamp[l].mtime.tv_nsec)
+			return FALSE;
+	}
+	__atomic_store_n(&ls->checked, now(), __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+/*
+ * Resolves the directory requested as path ("" for the root) in every
+ * layer that has it, and opens it there. Returns it with a reference for
+ * the caller, or NULL with errno set.
+ */
+static struct dopen *dopen_new(struct tree *t, const char *path)
+{
+	struct dopen *o;
+	struct walk w;
+	struct stat s;
+	size_t len = strlen(path);
+	unsigned int l, all = (1u << t->nlayers) - 1;
+	int err = ENOENT;
+
+	if (!(o = dopen_alloc(t, path, len)))
+		return NULL;
+
+	// Layers in which the directory has a different case are found by
+	// correcting the path, so that the listing merges all of them.
+	for (l = 0; l < t->nlayers && (!len || collision == COLLISION_EXACT); l++)
+	{
+		if ((o->fd[l] = openat(t->layers[l].fd, len ? path : DOT, O_PATH | O_DIRECTORY)) != -1)
+			o->live |= 1u << l;
+		else if (errno != ENOENT && err == ENOENT)
+			err = errno;
+	}
+	if (len && o->live != all && walk_path_case(t, path, &w))
+	{
+		for (l = 0; l < t->nlayers; l++)
+		{
+			if (o->live & (1u << l) || !(w.live & (1u << l)))
+				continue;
+			memcpy(o->real[l], w.real[l], len);
+			if ((o->fd[l] = openat(t->layers[l].fd, o->real[l], O_PATH | O_DIRECTORY)) != -1)
+				o->live |= 1u << l;
+		}
+		free(w.real[0]);
+	}
+
+	for (l = 0; l < t->nlayers; l++)
+	{
+		if (!(o->live & (1u << l)))
+			continue;
+		if (fstat(o->fd[l], &s) == -1)
+		{
+			close(o->fd[l]);
+			o->live &= ~(1u << l);
+		}
+		else
+			o->ino[l] = s.st_ino;
+	}
+	if (!o->live)
+	{
+		free(o);
+		errno = err;
+		return NULL;
+	}
+	o->refs = 1;
+	return o;
+}
+
+/*
+ * Closes a handle on o. The directory stays open for the lookups under
+ * it until it is the least recently used one over conf.dir_fds.
+ */
+static void dopen_release(struct tree *t, struct dopen *o)
+{
+	struct dcache *dc = &t->dcache;
+
+	pthread_mutex_lock(&dc->lock);
+	o->handles--;
+	pthread_mutex_unlock(&dc->lock);
+	dopen_put(o);
+	if (__atomic_load_n(&dir_fds_used, __ATOMIC_RELAXED) > dir_fds_limit())
+		dir_fds_reclaim();
+}
+
+/*
+ * Returns the directory requested as path[0..len) (whose path_hash() is
+ * hash) open, with a reference
+ * and a handle for the caller. It is only resolved and opened again if
+ * no handle has it open, or its real paths no longer lead to it.
+ */
+static struct dopen *dopen_get(struct tree *t, char *path, size_t len, unsigned int hash)
+{
+	struct dcache *dc = &t->dcache;
+	struct dopen *o = NULL;
+	struct policy pol;
+	struct dnode *n;
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, path, len, hash)) != NULL && (o = n->open) != NULL)
+	{
+		__atomic_add_fetch(&o->refs, 1, __ATOMIC_RELAXED);
+		o->handles++;
+		dnode_policy(t, n, &pol);
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	// The stats must not happen under the lock.
+	if (o && dopen_valid(t, o, &pol))
+		return o;
+	if (o)
+	{
+		dopen_forget(t, o);
+		dopen_release(t, o);
+	}
+
+	if (!(o = dopen_new(t, path)))
+		return NULL;
+	o->handles = 1;
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, path, len, hash)) != NULL)
+	{
+		dnode_close(dc, n);
+		dnode_open(dc, n, o);
+	}
+	pthread_mutex_unlock(&dc->lock);
+	if (__atomic_load_n(&dir_fds_used, __ATOMIC_RELAXED) > dir_fds_limit())
+		dir_fds_reclaim();
+	return o;
+}
+
+/*
+ * Open a directory and put its handle in fi->fh. A current snapshot of
+ * the listing is used if the directory has one; otherwise a stream is
+ * opened in each layer, and a snapshot taken from them.
+ */
+static int fuzzyfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	struct tree *t = cur_tree();
+	struct dcache *dc = &t->dcache;
+	struct dir_handle *h;
+	struct dlisting *ls = NULL;
+	struct dnode *n;
+	struct dopen *o;
+	struct walk w;
+	struct policy pol = { 0, 0 };
+	unsigned int l, hash, gen = 0;
+	int fd, err, watched = FALSE;
+	char *p;
+	size_t len;
+	DIR *dp;
+
+	if (!(h = calloc(1, sizeof(*h))))
+		return -ENOMEM;
+
+	// The node of the directory is keyed by the requested path, "" for the root.
+	p = (char*)fix_path(path);
+	if (!(p = strdup(p == DOT ? "" : p)))
+	{
+		free(h);
+		return -ENOMEM;
+	}
+	len = strlen(p);
+	hash = path_hash(p, len);
+	if (!(o = h->dir = dopen_get(t, p, len, hash)))
+	{
+		err = errno;
+		free(p);
+		free(h);
+		return -err;
+	}
+
+	pthread_mutex_lock(&dc->lock);
+	if ((n = dcache_get(dc, p, len, hash)) != NULL)
+	{
+		dnode_policy(t, n, &pol);
+		gen = n->gen;
+		watched = n->watched && pol.flags & POLICY_WATCHED;
+		if ((ls = n->listing) != NULL)
+			__atomic_add_fetch(&ls->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	// The stats must not happen under the lock.
+	if (ls && !(pol.flags & POLICY_NOCACHE) && dlisting_valid(ls, o, &pol, gen, watched))
+		h->listing = ls;
+	else if (ls)
+	{
+		pthread_mutex_lock(&dc->lock);
+		if ((n = dcache_get(dc, p, len, hash)) != NULL && n->listing == ls)
+		{
+			n->listing = NULL;
+			n->changed = now();
+			dlisting_put(ls);
+		}
+		pthread_mutex_unlock(&dc->lock);
+		dlisting_put(ls);
+	}
+
+	err = ENOENT;
+	for (l = 0; l < t->nlayers && !h->listing; l++)
+	{
+		if (!(o->live & (1u << l)))
+			continue;
+		if ((fd = openat(o->fd[l], DOT, O_RDONLY | O_DIRECTORY)) == -1 ||
+		    !(dp = fdopendir(fd)))
+		{
+			err = errno;
+			if (fd != -1)
+				close(fd);
+			continue;
+		}
+		h->layer[h->count] = l;
+		h->dp[h->count++] = dp;
+	}
+	if (!h->listing && !h->count)
+	{
+		free(p);
+		dopen_release(t, o);
+		free(h);
+		return -err;
+	}
+
+	if (!h->listing && TUNABLE(hide_duplicates))
+	{
+		w.t = t;
+		w.live = o->live;
+		w.base = 0;
+		for (l = 0; l < t->nlayers; l++)
+			w.real[l] = o->real[l];
+		h->index = dnode_index(&w, p, len, hash, &pol);
+		if (!h->index)
+		{
+			resolve_prio = RESOLVE_LIST;
+			h->index = dnode_build(&w, p, len, hash);
+			resolve_prio = RESOLVE_LOOKUP;
+		}
+	}
+	if (!h->listing && !(pol.flags & POLICY_NOCACHE) &&
+	    h->count == (unsigned int)__builtin_popcount(o->live) &&
+	    (ls = dlisting_take(h)) != NULL)
+	{
+		ls->gen = gen;
+		h->listing = ls;
+		pthread_mutex_lock(&dc->lock);
+		if ((n = dcache_get(dc, p, len, hash)) != NULL)
+		{
+			if (n->listing)
+				dlisting_put(n->listing);
+			n->listing = ls;
+			__atomic_add_fetch(&ls->refs, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&dc->lock);
+		if (TUNABLE(cache_mem) &&
+		    __atomic_load_n(&mem_used, __ATOMIC_RELAXED) > (size_t)TUNABLE(cache_mem) << 20)
+			mem_reclaim();
+	}
+	free(p);
+
+	// the snapshot is all we need from now on
+	if (h->listing)
+	{
+		for (l = 0; l < h->count; l++)
+			closedir(h->dp[l]);
+		h->count = 0;
+		if (h->index)
+			dindex_put(h->index);
+		h->index = NULL;
+	}
+
+	// fi->fh is a uint64_t, so we must cast. Casting directly to uint64_t
+	// generates a compiler warning, so we use uintptr_t.
+	fi->fh = (uintptr_t) h;
+	return 0;
+}
+
+// Where fuzzyfs_readdir() sends the entries read from the streams.
+struct dir_filler
+{
+	void *buf;
+	fuse_fill_dir_t filler;
+};
+
+static int dir_fill(void *ctx, const char *name, ino_t ino, unsigned char type)
+{
+	struct dir_filler *f = ctx;
+	struct stat st;
+
+	memset(&st, 0, sizeof(st));
+	st.st_ino = ino;
+	st.st_mode = type << 12;
+	return f->filler(f->buf, name, &st, 0);
+}
+
+// Reads the contents of a directory, from its snapshot if it has one.
+static int fuzzyfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	// Including an intermediate unitptr_t cast avoids a compiler warning.
+	struct dir_handle *h = (struct dir_handle*)(uintptr_t)fi->fh;
+	struct dir_filler f = { buf, filler };
+	struct dlisting *ls = h->listing;
+	unsigned int i;
+
+	if (ls)
+	{
+		for (i = 0; i < ls->count; i++)
+			if (dir_fill(&f, ls->names + ls->ents[i].name, ls->ents[i].ino, ls->ents[i].type))
+				return -ENOMEM;
+		return 0;
+	}
+
+	// offset 0 means the directory is being read (again) from the start
+	if (!offset)
+		for (i = 0; i < h->count; i++)
+			rewinddir(h->dp[i]);
+	return dir_read(h, dir_fill, &f);
+}
+
+// Close the directory streams pointed to by fi->fh.
+static int fuzzyfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	// Including an intermediate unitptr_t cast avoids a compiler warning.
+	struct dir_handle *h = (struct dir_handle*)(uintptr_t)fi->fh;
+	unsigned int i;
+	int res = 0;
+
+	for (i = 0; i < h->count; i++)
+		if (closedir(h->dp[i]) == -1)
+			res = -errno;
+	if (h->index)
+		dindex_put(h->index);
+	if (h->listing)
+		dlisting_put(h->listing);
+	dopen_release(cur_tree(), h->dir);
+	free(h);
+
+	return res;
+}
+
+// Open a file handle and put it in fi->fh.
+static int fuzzyfs_open(const char *path, struct fuse_file_info *fi)
+{
+	struct tree *t = cur_tree();
+	struct policy pol;
+	struct dopen *o;
+	const char *rel, *slash;
+	unsigned int l;
+	int res = -1, layer, err = ENOENT, fd;
+	size_t len;
+	char *p;
+
+	p = (char*)fix_path(path);
+	if (__atomic_load_n(&policy_any, __ATOMIC_RELAXED) & POLICY_DIRECT_IO)
+	{
+		slash = strrchr(p, '/');
+		len = slash ? (size_t)(slash - p) : 0;
+		dir_policy(t, p, len, path_hash(p, len), &pol);
+		fi->direct_io = !!(pol.flags & POLICY_DIRECT_IO);
+	}
+
+	// files in a directory kept open are reached from it
+	o = dopen_parent(t, p);
+	for (l = 0; l < t->nlayers && collision == COLLISION_EXACT && err == ENOENT; l++)
+	{
+		fd = dopen_at(t, o, l, p, &rel);
+		if ((res = openat(fd, rel, fi->flags)) != -1)
+		{
+			if (!layer_shadowed(t, p, l))
+				break;
+			close(res);
+			res = -1;
+			break;
+		}
+		err = errno;
+	}
+
+	// a trusted correction is reopened by its handle, if it has one
+	if (res == -1 && err == ENOENT)
+		res = pcache_open(t, p, fi->flags);
+
+	// Allocates new memory for p.
+	if (res == -1 && err == ENOENT && (p = fix_path_case(t, p, &layer)) != NULL)
+	{
+		fd = dopen_at(t, o, layer, p, &rel);
+		res = openat(fd, rel, fi->flags);
+		err = errno;
+		free(p);
+		p = NULL;
+	}
+	if (o)
+		dopen_put(o);
+	if (res == -1)
+		return -err;
+	fi->fh = res;
+	return 0;
+}
+
+// Read size bytes from the given file descriptor into the buffer buf, beginning offset bytes into the file.
+static int fuzzyfs_read(const char *path, char *buf, size_t size, off_t offset,
+			struct fuse_file_info *fi)
+{
+	(void) path;
+
+	int res;
+
+	res = pread(fi->fh, buf, size, offset);
+	if (res == -1)
+		res = -errno;
+
+	return res;
+}
+
+// Close the file descriptor.
+static int fuzzyfs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	int res;
+
+	res = close(fi->fh);
+	if (res == -1)
+		res = -errno;
+
+	return res;
+}
+
+/*
+ * A function called at the filesystem startup, once for every mount.
+ * All paths are resolved relative to the layers' directory descriptors,
+ * opened while parsing the arguments, instead of doing nasty
+ * directory-symlink appending.
+ */
+static void *fuzzyfs_init(struct fuse_conn_info *conn)
+{
+	struct mount *m = fuse_get_context()->private_data;
+	struct tree *t = m->tree;
+
+	// mounts sharing a tree share its warm thread too
+	if (t->warm_file && !__atomic_exchange_n(&t->warming, TRUE, __ATOMIC_ACQ_REL))
+	{
+		pthread_t th;
+
+		if (pthread_create(&th, NULL, warm_thread, t) == 0)
+			pthread_detach(th);
+	}
+
+	// this becomes the private_data of the requests to come
+	return m;
+}
+
+// Called on unmount. Saves the hot paths one last time.
+static void fuzzyfs_destroy(void *private_data)
+{
+	struct mount *m = private_data;
+
+	if (m->tree->warm_file)
+		warm_save(m->tree);
+}
+
+#define FUZZYFS_OPT(t, p) { t, offsetof(struct fuzzyfs_config, p), 0 }
+
+static struct fuse_opt fuzzyfs_opts[] = {
+	FUZZYFS_OPT("config=%s",	config),
+	FUZZYFS_OPT("threads=%u",	threads),
+	FUZZYFS_OPT("cache_mem=%u",	cache_mem),
+	FUZZYFS_OPT("warm_file=%s",	warm_file),
+	FUZZYFS_OPT("shm_index=%s",	shm_index),
+	FUZZYFS_OPT("shm_size=%u",	shm_size),
+	FUZZYFS_OPT("warm_interval=%u",	warm_interval),
+	FUZZYFS_OPT("cache_size=%u",	cache_size),
+	FUZZYFS_OPT("index_threshold=%u", index_threshold),
+	FUZZYFS_OPT("cache_timeout=%u",	cache_timeout),
+	FUZZYFS_OPT("cache_timeout_max=%u", cache_timeout_max),
+	FUZZYFS_OPT("control=%s",	control),
+	FUZZYFS_OPT("log_level=%s",	log_level),
+	FUZZYFS_OPT("collision=%s",	collision),
+	{ "hide_duplicates", offsetof(struct fuzzyfs_config, hide_duplicates), 1 },
+	FUZZYFS_OPT("hide_duplicates=%u", hide_duplicates),
+	FUZZYFS_OPT("dir_fds=%u",	dir_fds),
+	{ "handles", offsetof(struct fuzzyfs_config, handles), 1 },
+	FUZZYFS_OPT("handles=%u",	handles),
+	FUZZYFS_OPT("filter_min=%u",	filter_min),
+	{ "mph", offsetof(struct fuzzyfs_config, mph), 1 },
+	FUZZYFS_OPT("mph=%u",		mph),
+	FUZZYFS_OPT("compress_min=%u",	compress_min),
+	{ "huge_pages", offsetof(struct fuzzyfs_config, huge_pages), 1 },
+	FUZZYFS_OPT("huge_pages=%u",	huge_pages),
+	FUZZYFS_OPT("resolvers=%u",	resolvers),
+	FUZZYFS_OPT("bulk_threads=%u",	bulk_threads),
+	FUSE_OPT_END
+};
+
+// The first argument (the source) on the command line.
+static const char *sources;
+
+// The command line as given, whose options override the file's.
+static struct fuse_args cmdline;
+
+// Parse the arguments. Notably, sets sources to the first argument.
+static int fuzzyfs_opt_parse(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	// Note: this will be triggered only by the first argument.
+	if (!sources && key == FUSE_OPT_KEY_NONOPT)
+	{
+		sources = arg;
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Returns a newly allocated absolute version of path.
+ * When fuse starts, it changes the workdir to the root,
+ * so we must resolve relative paths beforehand.
+ */
+static char *abs_path(const char *path)
+{
+	char *cwd, *abs;
+
+	if (path[0] == '/')
+		return strdup(path);
+	if (!(cwd = getcwd(NULL, 0)))
+		return NULL;
+	if (asprintf(&abs, "%s/%s", cwd, path) == -1)
+		abs = NULL;
+	free(cwd);
+	return abs;
+}
+
+/*
+ * Returns the tree for the colon-separated list of source directories
+ * dirs, opening them unless some other mount already did.
+ * Returns NULL after printing an error.
+ */
+static struct tree *tree_get(const char *prog, const char *dirs,
+			     const char *warm_file, const char *shm_index)
+{
+	struct tree *t, *other;
+	char *list, *dir, *saveptr;
+	unsigned int l;
+
+	if (!(t = calloc(1, sizeof(*t))) || !(list = strdup(dirs)))
+	{
+		perror(prog);
+		exit(1);
+	}
+
+	for (dir = strtok_r(list, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr))
+	{
+		if (t->nlayers == MAX_LAYERS)
+		{
+			fprintf(stderr, "%s: at most %d source directories are supported\n",
+				prog, MAX_LAYERS);
+			exit(1);
+		}
+		if (!(t->layers[t->nlayers++].path = realpath(dir, NULL)))
+		{
+			perror(dir);
+			exit(1);
+		}
+	}
+	free(list);
+	if (!t->nlayers)
+	{
+		fprintf(stderr, "%s: no source directory given\n", prog);
+		exit(1);
+	}
+
+	for (other = trees; other; other = other->next)
+	{
+		if (other->nlayers != t->nlayers)
+			continue;
+		for (l = 0; l < t->nlayers; l++)
+			if (strcmp(other->layers[l].path, t->layers[l].path))
+				break;
+		if (l == t->nlayers)
+			break;
+	}
+	if (other)
+	{
+		for (l = 0; l < t->nlayers; l++)
+			free(t->layers[l].path);
+		free(t);
+		t = other;
+	}
+	else
+	{
+		for (l = 0; l < t->nlayers; l++)
+		{
+			if ((t->layers[l].fd = open(t->layers[l].path, O_RDONLY | O_DIRECTORY)) == -1)
+			{
+				perror(t->layers[l].path);
+				exit(1);
+			}
+			t->layers[l].mount_id = handle_mount(t->layers[l].fd);
+		}
+		pthread_mutex_init(&t->pcache.lock, NULL);
+		t->pcache.lru.lru_prev = t->pcache.lru.lru_next = &t->pcache.lru;
+		pthread_mutex_init(&t->dcache.lock, NULL);
+		t->dcache.lru.lru_prev = t->dcache.lru.lru_next = &t->dcache.lru;
+		t->next = trees;
+		trees = t;
+	}
+
+	if (warm_file && !t->warm_file && !(t->warm_file = abs_path(warm_file)))
+	{
+		perror(prog);
+		exit(1);
+	}
+	if (shm_index && !t->shm && !(t->shm = shm_create(t, shm_index)))
+		exit(1);
+	return t;
+}
+
+// Adds a mount of the source directories dirs at mountpoint.
+static void mount_add(const char *prog, const char *mountpoint, const char *dirs,
+		      struct fuse_args *args, const char *warm_file,
+		      const char *shm_index)
+{
+	struct mount *m, **last;
+
+	if (!(m = calloc(1, sizeof(*m))))
+	{
+		perror(prog);
+		exit(1);
+	}
+	if (!(m->mountpoint = realpath(mountpoint, NULL)))
+	{
+		perror(mountpoint);
+		exit(1);
+	}
+	m->tree = tree_get(prog, dirs, warm_file, shm_index);
+	if (args)
+		m->args = *args;
+
+	// keep them in order, the first mount gets the first worker
+	for (last = &mounts; *last; last = &(*last)->next)
+		;
+	*last = m;
+}
+
+// Options of a mount line in the configuration file.
+struct mount_opts
+{
+	char *warm_file;
+	char *shm_index;
+};
+
+static struct fuse_opt mount_opts[] = {
+	{ "warm_file=%s", offsetof(struct mount_opts, warm_file), 0 },
+	{ "shm_index=%s", offsetof(struct mount_opts, shm_index), 0 },
+	FUSE_OPT_END
+};
+
+// Other options of a mount line are passed to fuse for that mount.
+static int mount_opt_parse(void *data, const char *arg, int key,
+			   struct fuse_args *outargs)
+{
+	return 1;
+}
+
+// Settings in the configuration file are -o options of fuzzyfs only.
+static int config_opt_parse(void *data, const char *arg, int key,
+			    struct fuse_args *outargs)
+{
+	log_msg(LOG_ERR, "%s: unknown option '%s'\n", conf.config, arg);
+	return -1;
+}
+
+// Frees the strings of c.
+static void config_free(struct fuzzyfs_config *c)
+{
+	free(c->config);
+	free(c->warm_file);
+	free(c->shm_index);
+	free(c->control);
+	free(c->log_level);
+	free(c->collision);
+}
+
+// Frees the strings of old, a copy of c, that options parsed since replaced.
+static void config_free_replaced(const struct fuzzyfs_config *c, struct fuzzyfs_config *old)
+{
+	if (c->config != old->config)
+		free(old->config);
+	if (c->warm_file != old->warm_file)
+		free(old->warm_file);
+	if (c->shm_index != old->shm_index)
+		free(old->shm_index);
+	if (c->control != old->control)
+		free(old->control);
+	if (c->log_level != old->log_level)
+		free(old->log_level);
+	if (c->collision != old->collision)
+		free(old->collision);
+}
+
+/*
+ * Reads the settings in conf.config into c, and its policy rules into
+ * *rules. Each line holds a setting, named like the corresponding -o
+ * option and followed by its value if it takes one, a policy rule, or
+ * describes a mount:
+ *
+ *	threads 16
+ *	policy /var/www/a/htdocs/uploads watched,direct_io
+ *	mount /var/www/a/htdocs /srv/shared:/srv/a allow_other,warm_file=/var/cache/a
+ *
+ * Lines starting with '#' are comments. Mounts are only added when
+ * starting, and skipped when reloading.
+ * Returns -1 after logging an error.
+ */
+static int config_load(const char *prog, struct fuzzyfs_config *c, int reload,
+		       struct policy_rule **rules)
+{
+	FILE *f;
+	struct policy_rule **last = rules, *r;
+	char *line = NULL, *key, *mp, *dirs, *opts, *saveptr, *opt;
+	size_t cap = 0;
+	unsigned int lineno = 0;
+	int res = 0;
+
+	*rules = NULL;
+	if (!(f = fopen(conf.config, "r")))
+	{
+		log_msg(LOG_ERR, "%s: %s\n", conf.config, strerror(errno));
+		return -1;
+	}
+
+	while (!res && getline(&line, &cap, f) > 0)
+	{
+		lineno++;
+		if (!(key = strtok_r(line, " \t\n", &saveptr)) || key[0] == '#')
+			continue;
+
+		if (!strcmp(key, "policy"))
+		{
+			mp = strtok_r(NULL, " \t\n", &saveptr);
+			opts = strtok_r(NULL, " \t\n", &saveptr);
+			if (!opts || strtok_r(NULL, " \t\n", &saveptr) || !(r = policy_parse(mp, opts)))
+			{
+				log_msg(LOG_ERR, "%s:%u: usage: policy <path> frozen|watched|ttl=<seconds>|nocache|direct_io[,...]\n",
+					conf.config, lineno);
+				res = -1;
+				break;
+			}
+			*last = r;
+			last = &r->next;
+		}
+		else if (!strcmp(key, "mount"))
+		{
+			struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+			struct mount_opts mo = { NULL, NULL };
+
+			if (reload)
+				continue;
+			mp = strtok_r(NULL, " \t\n", &saveptr);
+			dirs = strtok_r(NULL, " \t\n", &saveptr);
+			opts = strtok_r(NULL, " \t\n", &saveptr);
+			if (!dirs || strtok_r(NULL, " \t\n", &saveptr))
+			{
+				log_msg(LOG_ERR, "%s:%u: usage: mount <mountpoint> <source>[:<source>...] [options]\n",
+					conf.config, lineno);
+				res = -1;
+				break;
+			}
+			fuse_opt_add_arg(&args, prog);
+			if (opts)
+			{
+				fuse_opt_add_arg(&args, "-o");
+				fuse_opt_add_arg(&args, opts);
+			}
+			if (fuse_opt_parse(&args, &mo, mount_opts, mount_opt_parse) == -1)
+			{
+				res = -1;
+				break;
+			}
+			mount_add(prog, mp, dirs, &args, mo.warm_file, mo.shm_index);
+			free(mo.warm_file);
+			free(mo.shm_index);
+		}
+		else
+		{
+			struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+			struct fuzzyfs_config prev;
+			char *value = strtok_r(NULL, " \t\n", &saveptr);
+
+			if (value ? asprintf(&opt, "%s=%s", key, value) == -1 : !(opt = strdup(key)))
+			{
+				log_msg(LOG_ERR, "%s: %s\n", prog, strerror(errno));
+				res = -1;
+				break;
+			}
+			fuse_opt_add_arg(&args, prog);
+			fuse_opt_add_arg(&args, "-o");
+			fuse_opt_add_arg(&args, opt);
+			prev = *c;
+			if (fuse_opt_parse(&args, c, fuzzyfs_opts, config_opt_parse) == -1)
+				res = -1;
+			config_free_replaced(c, &prev);
+			fuse_opt_free_args(&args);
+			free(opt);
+		}
+	}
+	free(line);
+	fclose(f);
+	if (res == -1)
+	{
+		policy_free(*rules);
+		*rules = NULL;
+	}
+	return res;
+}
+
+/*
+ * Frees *s, a string setting read again from the configuration file,
+ * warning if it tried to change old, since it is only used when starting.
+ */
+static void config_keep(const char *name, char *s, const char *old)
+{
+	if (s == old)
+		return;
+	if (!s || !old || strcmp(s, old))
+		log_msg(LOG_WARNING, "%s: %s can't be changed without restarting\n",
+			conf.config, name);
+	free(s);
+}
+
+// The settings before any option: what conf is initialized with.
+static struct fuzzyfs_config conf_defaults;
+
+// Only the options of fuzzyfs are of interest when reading them again.
+static int cmdline_opt_parse(void *data, const char *arg, int key,
+			     struct fuse_args *outargs)
+{
+	return 1;
+}
+
+/*
+ * Fills in c with the settings as they are to be: the defaults, then
+ * those of conf.config, then the -o options of the command line on top,
+ * and *rules with the policy rules of the file. Returns -1 after logging
+ * an error, with nothing left allocated.
+ */
+static int config_build(const char *prog, struct fuzzyfs_config *c, int reload,
+			struct policy_rule **rules)
+{
+	struct fuse_args args = FUSE_ARGS_INIT(cmdline.argc, cmdline.argv);
+	struct fuzzyfs_config file;
+	int res;
+
+	*c = conf_defaults;
+	if (config_load(prog, c, reload, rules) == -1)
+	{
+		config_free(c);
+		return -1;
+	}
+	file = *c;
+	res = fuse_opt_parse(&args, c, fuzzyfs_opts, cmdline_opt_parse);
+	config_free_replaced(c, &file);
+	if (res == -1)
+	{
+		log_msg(LOG_ERR, "%s: can't parse the command line again\n", prog);
+		policy_free(*rules);
+		*rules = NULL;
+		config_free(c);
+		return -1;
+	}
+	fuse_opt_free_args(&args);
+	return 0;
+}
+
+/*
+ * The control socket, -o control=PATH: a unix socket on which the
+ * owner of the file system can manage the caches while it is running.
+ * Each line sent is a command, answered by zero or more lines of output
+ * and then "ok" or "error: <reason>":
+ *
+ *	invalidate <path>	forget everything cached at and under path
+ *	warm <path>		index every directory under path
+ *	stats			counters of every tree
+ *	set-timeout <seconds>	change cache_timeout
+ *
+ * Paths are given as seen under a mountpoint, or relative to it when
+ * there is a single one. Commands are run by a thread of their own, one
+ * connection at a time, so they never hold up requests to the mounts. A
+ * connection left idle for CONTROL_IDLE seconds, or not reading what it
+ * is sent, is closed so that it does not hold up the others either.
+ */
+#define CONTROL_IDLE	5
+
+static int control_fd = -1;
+static char *control_path;		// conf.control made absolute
+
+/*
+ * Finds the tree path is in, setting *rel to the path relative to the
+ * sources (DOT for their root). Returns NULL if path is under no mount.
+ */
+static struct tree *control_tree(char *path, const char **rel)
+{
+	struct mount *m;
+	size_t len = strlen(path), mlen;
+
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = '\0';
+
+	if (path[0] != '/')
+	{
+		if (!mounts || mounts->next)
+			return NULL;
+		*rel = strcmp(path, DOT) ? path : DOT;
+		return mounts->tree;
+	}
+
+	for (m = mounts; m; m = m->next)
+	{
+		mlen = strlen(m->mountpoint);
+		if (!strcmp(m->mountpoint, "/"))
+			mlen = 0;
+		if (strncmp(path, m->mountpoint, mlen) || (path[mlen] && path[mlen] != '/'))
+			continue;
+		*rel = path[mlen] && path[mlen + 1] ? path + mlen + 1 : DOT;
+		return m->tree;
+	}
+	return NULL;
+}
+
+/*
+ * Forgets the cached corrections, indexes and listings of the directory
+ * or file rel and everything under it, as well as the index of its
+ * parent, which lists it. The shared memory segment is cleared too, since it
+ * can't be searched by prefix.
+ */
+static void control_invalidate(struct tree *t, const char *rel)
+{
+	struct pcache *pc = &t->pcache;
+	struct dcache *dc = &t->dcache;
+	struct pcache_entry **e;
+	struct dnode *n;
+	const char *slash = strrchr(rel, '/');
+	size_t i, plen = rel == DOT ? 0 : slash ? (size_t)(slash - rel) : 0;
+
+	pthread_mutex_lock(&pc->lock);
+	for (i = 0; pc->table && i < pc->size; i++)
+	{
+		for (e = &pc->table[i]; *e;)
+		{
+			if (path_under((*e)->path, rel))
+				pcache_unlink(pc, e);
+			else
+				e = &(*e)->next;
+		}
+	}
+	pthread_mutex_unlock(&pc->lock);
+
+	pthread_mutex_lock(&dc->lock);
+	for (n = dc->lru.lru_next; n != &dc->lru; n = n->lru_next)
+	{
+		if (!path_under(n->path, rel) &&
+		    (rel == DOT || strlen(n->path) != plen || strncasecmp(n->path, rel, plen)))
+			continue;
+		n->misses = 0;
+		n->gen = ++dc->gen;
+		dnode_drop(n);
+		dnode_close(dc, n);
+	}
+	pthread_mutex_unlock(&dc->lock);
+
+	if (t->shm)
+	{
+		pthread_mutex_lock(&t->shm->lock);
+		shm_clear(t->shm);
+		pthread_mutex_unlock(&t->shm->lock);
+	}
+}
+
+/*
+ * Indexes the directory dir[0..len) (as requested, len is 0 for the
+ * root), whose real paths are in w, and every directory under it, dir
+ * being a PATH_MAX buffer. The directories under it are looked at from
+ * descriptors of dir, their real paths made from its own and the names
+ * its index has, rather than walked to from the root again. Symbolic
+ * links are not followed. Returns the number of directories indexed, or
+ * -1 with errno set if dir itself could not be read.
+ */
+static long control_warm(struct walk *w, char *dir, size_t len)
+{
+	struct tree *t = w->t;
+	struct dindex *idx;
+	struct dopen *o = NULL;
+	struct walk sw;
+	struct stat s;
+	struct dindex_match *m;
+	const char *rel;
+	unsigned int i, k, l;
+	size_t nlen, sub;
+	long count = 1, res;
+	char *buf;
+	int fd;
+
+	if (!(idx = dnode_build(w, dir, len, path_hash(dir, len))))
+		return errno ? -1 : 0;
+	// not on the stack, this recurses
+	if (!(m = malloc(sizeof(*m))))
+	{
+		dindex_put(idx);
+		return -1;
+	}
+
+	// The root has descriptors already; without these, the real paths
+	// are still whole, just slower to follow.
+	if (len && (o = dopen_alloc(t, dir, len)) != NULL)
+	{
+		o->refs = 1;
+		for (l = 0; l < t->nlayers; l++)
+		{
+			if (!(w->live & (1u << l)))
+				continue;
+			fd = walk_at(w, l, len, &rel);
+			if ((o->fd[l] = openat(fd, rel, O_PATH | O_DIRECTORY)) != -1)
+				o->live |= 1u << l;
+		}
+	}
+
+	for (i = 0; i < dindex_size(idx); i++)
+	{
+		if (!dindex_entry(idx, i, m))
+			continue;
+		nlen = strlen(m->name[0]);
+		sub = len ? len + 1 + nlen : nlen;
+		if (sub >= PATH_MAX || !(buf = malloc(t->nlayers * (sub + 1))))
+			continue;
+
+		if (len)
+			dir[len] = '/';
+		memcpy(dir + sub - nlen, m->name[0], nlen + 1);
+
+		sw.t = t;
+		sw.live = 0;
+		sw.base = o ? len : 0;
+		sw.open = o;
+		for (l = 0; l < t->nlayers; l++)
+		{
+			sw.real[l] = buf + l * (sub + 1);
+			memcpy(sw.real[l], dir, sub + 1);
+		}
+		// Only the layers in which it is a directory are indexed, and
+		// the winning layer decides whether it is one at all.
+		for (k = 0; k < m->count; k++)
+		{
+			l = m->layer[k];
+			if (len)
+				memcpy(sw.real[l], w->real[l], len);
+			memcpy(sw.real[l] + sub - nlen, m->name[k], nlen + 1);
+			fd = walk_at(&sw, l, sub, &rel);
+			if (w->live & (1u << l) && (!o || o->live & (1u << l)) &&
+			    fstatat(fd, rel, &s, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(s.st_mode))
+				sw.live |= 1u << l;
+			else if (!k)
+				break;
+		}
+		if (k == m->count && sw.live && (res = control_warm(&sw, dir, sub)) > 0)
+			count += res;
+		free(buf);
+		dir[len] = '\0';
+	}
+	if (o)
+		dopen_put(o);
+	free(m);
+	dindex_put(idx);
+	return count;
+}
+
+// Runs the command in line, writing the answer to fd.
+static void control_command(int fd, char *line)
+{
+	char *cmd, *arg, *end, buf[PATH_MAX];
+	const char *rel;
+	struct tree *t;
+	struct walk w;
+	unsigned long v;
+	unsigned int l;
+	size_t len;
+	long count;
+
+	line[strcspn(line, "\r\n")] = '\0';
+	cmd = line;
+	if ((arg = strchr(line, ' ')) != NULL)
+		*arg++ = '\0';
+
+	if (!strcmp(cmd, "invalidate") || !strcmp(cmd, "warm"))
+	{
+		if (!arg || !*arg)
+		{
+			dprintf(fd, "error: usage: %s <path>\n", cmd);
+			return;
+		}
+		if (!(t = control_tree(arg, &rel)))
+		{
+			dprintf(fd, "error: %s: not under a mountpoint\n", arg);
+			return;
+		}
+		if (cmd[0] == 'i')
+		{
+			control_invalidate(t, rel);
+			dprintf(fd, "ok\n");
+			return;
+		}
+		if (strlen(rel) >= sizeof(buf))
+		{
+			dprintf(fd, "error: %s: %s\n", arg, strerror(ENAMETOOLONG));
+			return;
+		}
+		strcpy(buf, rel == DOT ? "" : rel);
+		if (!(len = strlen(buf)))
+		{
+			w.t = t;
+			w.live = (1u << t->nlayers) - 1;
+			w.base = 0;
+			w.open = NULL;
+			for (l = 0; l < t->nlayers; l++)
+				w.real[l] = buf;
+		}
+		else if (!walk_path_case(t, buf, &w))
+		{
+			dprintf(fd, "error: %s: %s\n", arg, strerror(errno ? errno : ENOENT));
+			return;
+		}
+		count = control_warm(&w, buf, len);
+		if (len)
+			free(w.real[0]);
+		if (count == -1)
+			dprintf(fd, "error: %s: %s\n", arg, strerror(errno ? errno : ENOENT));
+		else
+			dprintf(fd, "indexed %ld\nok\n", count);
+	}
+	else if (!strcmp(cmd, "stats"))
+	{
+		for (t = trees; t; t = t->next)
+		{
+			dprintf(fd, "tree ");
+			for (l = 0; l < t->nlayers; l++)
+				dprintf(fd, "%s%s", l ? ":" : "", t->layers[l].path);
+			dprintf(fd, "\n");
+			pthread_mutex_lock(&t->pcache.lock);
+			dprintf(fd, "  corrections %zu\n", t->pcache.count);
+			pthread_mutex_unlock(&t->pcache.lock);
+			pthread_mutex_lock(&t->dcache.lock);
+			dprintf(fd, "  directories %zu\n", t->dcache.count);
+			pthread_mutex_unlock(&t->dcache.lock);
+#define STAT_PRINT(counter) \
+	dprintf(fd, "  " #counter " %lu\n", __atomic_load_n(&t->stats.counter, __ATOMIC_RELAXED))
+			STAT_PRINT(lookups);
+			STAT_PRINT(cache_hits);
+			STAT_PRINT(index_hits);
+			STAT_PRINT(scans);
+			STAT_PRINT(builds);
+			STAT_PRINT(filter_hits);
+#undef STAT_PRINT
+		}
+		dprintf(fd, "index_bytes %zu\ncache_mem %u\ncache_timeout %u\nok\n",
+			__atomic_load_n(&mem_used, __ATOMIC_RELAXED), TUNABLE(cache_mem),
+			TUNABLE(cache_timeout));
+	}
+	else if (!strcmp(cmd, "set-timeout"))
+	{
+		errno = 0;
+		v = arg ? strtoul(arg, &end, 10) : 0;
+		if (!arg || !*arg || *end || errno || v > UINT_MAX)
+		{
+			dprintf(fd, "error: usage: set-timeout <seconds>\n");
+			return;
+		}
+		__atomic_store_n(&conf.cache_timeout, v, __ATOMIC_RELAXED);
+		dprintf(fd, "ok\n");
+	}
+	else if (*cmd)
+		dprintf(fd, "error: unknown command '%s'\n", cmd);
+}
+
+static void *control_thread(void *arg)
+{
+	static const struct timeval idle = { CONTROL_IDLE, 0 };
+	char *line = NULL;
+	size_t cap = 0;
+	FILE *f;
+	int fd;
+
+	(void) arg;
+
+	resolve_prio = RESOLVE_WARM;
+	for (;;)
+	{
+		if ((fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC)) == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle));
+		if (!(f = fdopen(fd, "r")))
+		{
+			close(fd);
+			continue;
+		}
+		while (getline(&line, &cap, f) > 0)
+		{
+			errno = 0;
+			control_command(fd, line);
+		}
+		fclose(f);
+	}
+	free(line);
+	return NULL;
+}
+
+/*
+ * Listens on conf.control, replacing a socket left over by a previous
+ * run. Only our own user may connect. Returns -1 after printing an error.
+ */
+static int control_open(const char *prog)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct stat s;
+	mode_t mask;
+	int res;
+
+	if (strlen(control_path) >= sizeof(sun.sun_path))
+	{
+		fprintf(stderr, "%s: %s: %s\n", prog, control_path, strerror(ENAMETOOLONG));
+		return -1;
+	}
+	strcpy(sun.sun_path, control_path);
+
+	if ((control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+	{
+		perror(prog);
+		return -1;
+	}
+	if (!lstat(control_path, &s) && S_ISSOCK(s.st_mode))
+		unlink(control_path);
+	mask = umask(077);
+	res = bind(control_fd, (struct sockaddr*)&sun, sizeof(sun));
+	umask(mask);
+	if (res == -1 || listen(control_fd, 4) == -1)
+	{
+		perror(control_path);
+		close(control_fd);
+		control_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+// Setup the mapping between the fuse functions and the fuzzyfs functions.
+static struct fuse_operations fuzzyfs_oper = {
 	.getattr	= fuzzyfs_getattr,
 	.opendir	= fuzzyfs_opendir,
 	.readdir	= fuzzyfs_readdir,
@@ -343,12 +5400,495 @@ static struct fuse_operations fuzzyfs_oper = {
 	.read		= fuzzyfs_read,
 	.release	= fuzzyfs_release,
 	.init		= fuzzyfs_init,
+	.destroy	= fuzzyfs_destroy,
+};
+
+static void loop_signal(int sig)
+{
+	char c = sig;
+
+	if (write(loop.sig[1], &c, 1) == -1)
+		return;
+}
+
+// (Re)enables waiting for the next request of m, in one worker only.
+static void loop_arm(struct mount *m, int op)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = m };
+
+	epoll_ctl(loop.epfd, op, fuse_chan_fd(m->ch), &ev);
+}
+
+/*
+ * Big sequential reads, such as those of a backup, can keep every worker
+ * busy while interactive requests wait for one. So requests are sorted
+ * once read: reads are bulk, and so is everything asked by processes in
+ * the idle I/O class (ionice -c3) or with a positive nice value. With
+ * conf.bulk_threads, at most that many workers process bulk requests at
+ * once, leaving the others to the rest. The bulk requests beyond wait in
+ * a queue of up to BULK_QUEUE, taken in order by the workers as they are
+ * done with bulk ones; once it is full they are processed right away.
+ * Any still queued when the workers stop are processed by run().
+ */
+#define BULK_QUEUE	64
+
+// The start of every request, as the kernel sends it (see fuse_kernel.h).
+struct fuse_head
+{
+	uint32_t len;
+	uint32_t opcode;
+	uint64_t unique;
+	uint64_t nodeid;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t pid;
+	uint32_t padding;
+};
+
+#define FUSE_OP_READ		15
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+
+// A bulk request waiting for a worker, a copy of what was read.
+struct bulk
+{
+	struct bulk *next;
+	struct mount *m;
+	struct fuse_chan *ch;
+	size_t len;
+	char buf[];
 };
 
+// Tells whether the request in buf[0..len) is bulk.
+static int loop_is_bulk(const char *buf, size_t len)
+{
+	struct fuse_head h;
+	int prio;
+
+	if (len < sizeof(h))
+		return FALSE;
+	memcpy(&h, buf, sizeof(h));
+	if (h.opcode == FUSE_OP_READ)
+		return TRUE;
+	// 0 for the kernel's own requests
+	if (!h.pid)
+		return FALSE;
+	prio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, (int)h.pid);
+	if (prio != -1 && prio >> IOPRIO_CLASS_SHIFT == IOPRIO_CLASS_IDLE)
+		return TRUE;
+	errno = 0;
+	prio = getpriority(PRIO_PROCESS, h.pid);
+	return !errno && prio > 0;
+}
+
+/*
+ * Processes the request in buf[0..len) of m, which came in on ch, now or
+ * later as its class allows. Then, if it was bulk, goes on with queued
+ * bulk requests until there are none.
+ */
+static void loop_process(struct mount *m, struct fuse_chan *ch, const char *buf, size_t len)
+{
+	unsigned int max = TUNABLE(bulk_threads);
+	struct bulk *b = NULL;
+
+	if (!max || !loop.multithreaded || !loop_is_bulk(buf, len))
+	{
+		fuse_session_process(m->se, buf, len, ch);
+		return;
+	}
+
+	pthread_mutex_lock(&loop.lock);
+	if (loop.bulk >= max && loop.queued < BULK_QUEUE && (b = malloc(sizeof(*b) + len)) != NULL)
+	{
+		b->next = NULL;
+		b->m = m;
+		b->ch = ch;
+		b->len = len;
+		memcpy(b->buf, buf, len);
+		*loop.queue_tail = b;
+		loop.queue_tail = &b->next;
+		loop.queued++;
+		pthread_mutex_unlock(&loop.lock);
+		return;
+	}
+	loop.bulk++;
+	pthread_mutex_unlock(&loop.lock);
+
+	fuse_session_process(m->se, buf, len, ch);
+	for (;;)
+	{
+		pthread_mutex_lock(&loop.lock);
+		// fewer of them may be allowed by now, or no limit at all
+		max = TUNABLE(bulk_threads);
+		if (!(b = loop.queue) || (max && loop.bulk > max))
+		{
+			loop.bulk--;
+			pthread_mutex_unlock(&loop.lock);
+			break;
+		}
+		if (!(loop.queue = b->next))
+			loop.queue_tail = &loop.queue;
+		loop.queued--;
+		pthread_mutex_unlock(&loop.lock);
+
+		fuse_session_process(b->m->se, b->buf, b->len, b->ch);
+		free(b);
+	}
+}
+
+static void *loop_worker(void *arg)
+{
+	struct epoll_event ev;
+	struct fuse_chan *ch;
+	struct mount *m;
+	char *buf, c;
+	int res;
+
+	(void) arg;
+
+	loop_self = TRUE;
+	if (!(buf = malloc(loop.bufsize)))
+		goto out;
+
+	for (;;)
+	{
+		res = epoll_wait(loop.epfd, &ev, 1, -1);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res != 1 || ev.data.ptr == &loop.wake)
+			break;
+		// several workers may wake up for a byte, only one gets it
+		if (ev.data.ptr == &loop.retire)
+		{
+			if (read(loop.retire[0], &c, 1) == 1)
+				break;
+			continue;
+		}
+
+		m = ev.data.ptr;
+		ch = m->ch;
+		res = fuse_chan_recv(&ch, buf, loop.bufsize);
+		if (res == -EINTR || res == -EAGAIN)
+		{
+			loop_arm(m, EPOLL_CTL_MOD);
+			continue;
+		}
+		if (res <= 0 || fuse_session_exited(m->se))
+		{
+			// unmounted from the outside; exit once all of them are
+			m->gone = TRUE;
+			if (__atomic_sub_fetch(&loop.active, 1, __ATOMIC_ACQ_REL) == 0)
+				loop_signal(SIGTERM);
+			continue;
+		}
+
+		// let another worker take the next request of this mount
+		loop_arm(m, EPOLL_CTL_MOD);
+		loop_process(m, ch, buf, res);
+	}
+
+	free(buf);
+out:
+	pthread_mutex_lock(&loop.lock);
+	loop.running--;
+	pthread_cond_signal(&loop.idle);
+	pthread_mutex_unlock(&loop.lock);
+	return NULL;
+}
+
+/*
+ * Starts or retires workers until there are n of them. Retiring ones
+ * finish the request they are processing first.
+ */
+static void loop_resize(unsigned int n)
+{
+	pthread_attr_t attr;
+	pthread_t th;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&loop.lock);
+	while (loop.workers < n && pthread_create(&th, &attr, loop_worker, NULL) == 0)
+	{
+		loop.workers++;
+		loop.running++;
+	}
+	while (loop.workers > n && write(loop.retire[1], "", 1) == 1)
+		loop.workers--;
+	pthread_mutex_unlock(&loop.lock);
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Applies the settings in conf.config again, on SIGHUP. Those that
+ * can't change without restarting are left alone with a warning, and so
+ * is everything if the file has an error. Requests in flight are not
+ * held up: they see either the old value of each setting or the new one.
+ */
+static void config_reload(void)
+{
+	struct fuzzyfs_config c;
+	struct policy_rule *rules;
+	unsigned int p;
+	int prio = LOG_INFO;
+
+	if (config_build("fuzzyfs", &c, TRUE, &rules) == -1)
+	{
+		log_msg(LOG_ERR, "%s: not reloaded\n", conf.config);
+		return;
+	}
+	if (c.log_level && (prio = log_parse(c.log_level)) == -1)
+	{
+		log_msg(LOG_ERR, "%s: unknown log_level '%s'\n", conf.config, c.log_level);
+		log_msg(LOG_ERR, "%s: not reloaded\n", conf.config);
+		policy_free(rules);
+		config_free(&c);
+		return;
+	}
+	policy_set(rules);
+
+	config_keep("config", c.config, conf.config);
+	config_keep("warm_file", c.warm_file, conf.warm_file);
+	config_keep("shm_index", c.shm_index, conf.shm_index);
+	config_keep("control", c.control, conf.control);
+	config_keep("collision", c.collision, conf.collision);
+	if (c.shm_size != conf.shm_size)
+		log_msg(LOG_WARNING, "%s: shm_size can't be changed without restarting\n",
+			conf.config);
+	// read by log_msg() through log_prio only
+	free(conf.log_level);
+	conf.log_level = c.log_level;
+	__atomic_store_n(&log_prio, prio, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&conf.cache_mem, c.cache_mem, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.cache_size, c.cache_size, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.index_threshold, c.index_threshold, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.cache_timeout, c.cache_timeout, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.cache_timeout_max, c.cache_timeout_max, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.hide_duplicates, c.hide_duplicates, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.dir_fds, c.dir_fds, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.handles, c.handles, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.filter_min, c.filter_min, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.mph, c.mph, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.compress_min, c.compress_min, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.huge_pages, c.huge_pages, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.bulk_threads, c.bulk_threads, __ATOMIC_RELAXED);
+	__atomic_store_n(&conf.warm_interval, c.warm_interval ? c.warm_interval : 1,
+			 __ATOMIC_RELAXED);
+	if (loop.multithreaded && c.threads)
+	{
+		conf.threads = c.threads;
+		loop_resize(c.threads);
+	}
+
+	// scans waiting for their turn may get it now
+	pthread_mutex_lock(&resolve.lock);
+	__atomic_store_n(&conf.resolvers, c.resolvers, __ATOMIC_RELAXED);
+	for (p = 0; p < RESOLVE_PRIOS; p++)
+		pthread_cond_broadcast(&resolve.turn[p]);
+	pthread_mutex_unlock(&resolve.lock);
+
+	if (TUNABLE(cache_mem) &&
+	    __atomic_load_n(&mem_used, __ATOMIC_RELAXED) > (size_t)TUNABLE(cache_mem) << 20)
+		mem_reclaim();
+	dir_fds_reclaim();
+	log_msg(LOG_INFO, "%s: reloaded\n", conf.config);
+}
+
+/*
+ * Mounts everything in mounts, with the fuse options in base plus
+ * those of each mount, and serves them until we are told to exit or
+ * all of them are unmounted. SIGHUP reloads the configuration file.
+ */
+static int run(struct fuse_args *base, int foreground)
+{
+	struct epoll_event wake = { .events = EPOLLIN, .data.ptr = &loop.wake };
+	struct epoll_event retire = { .events = EPOLLIN, .data.ptr = &loop.retire };
+	struct sigaction sa = { .sa_handler = loop_signal };
+	struct mount *m;
+	struct bulk *b;
+	pthread_t control;
+	unsigned int i;
+	char sig;
+	int res = 1;
+
+	for (m = mounts; m; m = m->next)
+	{
+		struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+
+		for (i = 0; i < (unsigned int)base->argc; i++)
+			fuse_opt_add_arg(&args, base->argv[i]);
+		for (i = 1; i < (unsigned int)m->args.argc; i++)
+			fuse_opt_add_arg(&args, m->args.argv[i]);
+
+		if ((m->ch = fuse_mount(m->mountpoint, &args)) != NULL &&
+		    !(m->fuse = fuse_new(m->ch, &args, &fuzzyfs_oper, sizeof(fuzzyfs_oper), m)))
+		{
+			fuse_unmount(m->mountpoint, m->ch);
+			m->ch = NULL;
+		}
+		fuse_opt_free_args(&args);
+		if (!m->fuse)
+			goto out;
+
+		m->se = fuse_get_session(m->fuse);
+		fcntl(fuse_chan_fd(m->ch), F_SETFL, O_NONBLOCK);
+		if (fuse_chan_bufsize(m->ch) > loop.bufsize)
+			loop.bufsize = fuse_chan_bufsize(m->ch);
+	}
+
+	// bound before daemonizing, so that errors can still be seen
+	if (conf.control && control_open("fuzzyfs") == -1)
+		goto out;
+	if (fuse_daemonize(foreground) == -1)
+		goto out;
+	if (!foreground)
+	{
+		openlog("fuzzyfs", LOG_PID, LOG_DAEMON);
+		log_syslog = TRUE;
+	}
+
+	if (pipe(loop.wake) == -1 || pipe2(loop.retire, O_NONBLOCK) == -1 ||
+	    pipe(loop.sig) == -1 || (loop.epfd = epoll_create1(0)) == -1 ||
+	    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.wake[0], &wake) == -1 ||
+	    epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.retire[0], &retire) == -1)
+	{
+		log_msg(LOG_ERR, "fuzzyfs: %s\n", strerror(errno));
+		goto out;
+	}
+	for (m = mounts; m; m = m->next, loop.active++)
+		loop_arm(m, EPOLL_CTL_ADD);
+
+	if (control_fd != -1 && pthread_create(&control, NULL, control_thread, NULL) == 0)
+		pthread_detach(control);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	loop_resize(conf.threads);
+	if (loop.running)
+		res = 0;
+	while (loop.running)
+	{
+		if (read(loop.sig[0], &sig, 1) != 1)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (sig != SIGHUP)
+			break;
+		if (conf.config)
+			config_reload();
+	}
+
+	// wake up every worker and wait for them to finish
+	if (write(loop.wake[1], "", 1) == -1)
+		res = 1;
+	pthread_mutex_lock(&loop.lock);
+	while (loop.running)
+		pthread_cond_wait(&loop.idle, &loop.lock);
+	pthread_mutex_unlock(&loop.lock);
+
+	// the kernel waits for an answer to every request, even queued ones
+	while ((b = loop.queue) != NULL)
+	{
+		loop.queue = b->next;
+		fuse_session_process(b->m->se, b->buf, b->len, b->ch);
+		free(b);
+	}
+	loop.queue_tail = &loop.queue;
+	loop.queued = 0;
+
+out:
+	for (m = mounts; m; m = m->next)
+	{
+		if (!m->fuse)
+			continue;
+		fuse_unmount(m->mountpoint, m->ch);
+		fuse_destroy(m->fuse);
+	}
+	if (control_fd != -1)
+		unlink(control_path);
+	return res;
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	fuse_opt_parse(&args, NULL, NULL, fuzzyfs_opt_parse);
+	struct fuzzyfs_config c;
+	struct policy_rule *rules;
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+
+	// before any tree exists, as they all hash alike
+	if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key))
+	{
+		perror("getrandom");
+		return 1;
+	}
+	conf_defaults = conf;
+	cmdline = args;
+	if (fuse_opt_parse(&args, &conf, fuzzyfs_opts, fuzzyfs_opt_parse) == -1)
+		return 1;
+	// the file only has the settings the command line leaves alone
+	if (conf.config)
+	{
+		if (config_build(argv[0], &c, FALSE, &rules) == -1)
+			return 1;
+		config_free(&conf);
+		conf = c;
+		policy_set(rules);
+	}
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+
+	if (sources)
+	{
+		if (!mountpoint)
+		{
+			fprintf(stderr, "%s: no mountpoint given\n", argv[0]);
+			return 1;
+		}
+		mount_add(argv[0], mountpoint, sources, NULL, conf.warm_file, conf.shm_index);
+	}
+	if (!mounts)
+	{
+		fprintf(stderr, "usage: %s <source>[:<source>...] <mountpoint> [options]\n"
+			"       %s -o config=<file> [options]\n", argv[0], argv[0]);
+		return 1;
+	}
+	if (conf.log_level && (log_prio = log_parse(conf.log_level)) == -1)
+	{
+		fprintf(stderr, "%s: unknown log_level '%s'\n", argv[0], conf.log_level);
+		return 1;
+	}
+	if (conf.collision)
+	{
+		for (collision = 0; collision < (int)(sizeof(collision_names) / sizeof(*collision_names)); collision++)
+			if (!strcmp(conf.collision, collision_names[collision]))
+				break;
+		if (collision == sizeof(collision_names) / sizeof(*collision_names))
+		{
+			fprintf(stderr, "%s: unknown collision '%s'\n", argv[0], conf.collision);
+			return 1;
+		}
+	}
+	loop.multithreaded = multithreaded;
+	if (!multithreaded || !conf.threads)
+		conf.threads = 1;
+	if (!conf.warm_interval)
+		conf.warm_interval = 1;
+	nofile_set(FALSE);
+	if (conf.control && !(control_path = abs_path(conf.control)))
+	{
+		perror(argv[0]);
+		return 1;
+	}
+
 	umask(0);
-	return fuse_main(args.argc, args.argv, &fuzzyfs_oper, NULL);
+	return run(&args, foreground);
 }
@@ -0,0 +1,266 @@
+/*
+ * fuzzyfs: Case-insensitive FUSE file system
+ * Copyright (C) 2020  Joel Puig Rubio <joel.puig.rubio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Layout of the shared memory index published with -o shm_index=NAME,
+ * and the lock-free protocol to read it from other processes.
+ *
+ * The segment maps the case-folded path of every name in an indexed
+ * directory (relative to the source, without a leading slash) to the
+ * real spelling of its last component, once per layer. It is written by
+ * fuzzyfs only, which creates it anew on every run with mode 0600:
+ * readers must run as the same user, and open it again once fuzzyfs was
+ * restarted. They map it read-only with shm_open(NAME, O_RDONLY) and
+ * never block it:
+ *
+ * - Each slot carries a sequence number that is odd while fuzzyfs is
+ *   writing it. A reader copies the slot and retries if the number was
+ *   odd or changed meanwhile.
+ * - The segment as a whole carries another one, odd while it is being
+ *   cleared. Names are only ever appended until then, so a name copied
+ *   from a slot is valid if that number did not change.
+ *
+ * Only directories fuzzyfs needed to index are published, so a miss
+ * means "unknown", not "does not exist": the caller should then try the
+ * name as it is, and finally ask the file system.
+ */
+
+#ifndef FUZZYFS_SHM_H
+#define FUZZYFS_SHM_H
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FUZZYFS_SHM_MAGIC	0x7a7a7566	/* "fuzz" */
+#define FUZZYFS_SHM_VERSION	2
+
+struct fuzzyfs_shm_slot
+{
+	uint32_t seq;			/* odd while being written */
+	uint32_t layer;
+	uint64_t hash;			/* of the folded path, 0 if empty */
+	uint32_t name;			/* offset of the real name in the names area */
+	uint32_t len;			/* its length, without the NUL */
+};
+
+struct fuzzyfs_shm
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;			/* odd while the segment is being cleared */
+	uint32_t nlayers;
+	uint32_t layers;		/* offset of the NUL-separated source directories */
+	uint32_t slots;			/* offset of the slot array */
+	uint32_t nslots;		/* a power of two */
+	uint32_t names;			/* offset of the names area */
+	uint32_t names_size;
+	uint32_t names_used;
+	uint64_t key[2];		/* of the hash, random for each run of fuzzyfs */
+};
+
+/*
+ * Paths are hashed case-insensitively with SipHash-1-3, keyed with the
+ * segment's key so that names can't be crafted to collide without
+ * knowing it, a component at a time:
+ *
+ *   hash("") = 0
+ *   hash("dir/name") = join(hash("dir"), name("name"))
+ *
+ * where name() hashes the ASCII-lowercased bytes of a name, and join()
+ * the two 64-bit values. Empty components are skipped, so "a//b" hashes
+ * like "a/b". Slots never use 0, it is taken as 1.
+ */
+struct fuzzyfs_sip
+{
+	uint64_t v0, v1, v2, v3;
+};
+
+#define FUZZYFS_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void fuzzyfs_sip_round(struct fuzzyfs_sip *s)
+{
+	s->v0 += s->v1;
+	s->v1 = FUZZYFS_ROTL(s->v1, 13);
+	s->v1 ^= s->v0;
+	s->v0 = FUZZYFS_ROTL(s->v0, 32);
+	s->v2 += s->v3;
+	s->v3 = FUZZYFS_ROTL(s->v3, 16);
+	s->v3 ^= s->v2;
+	s->v0 += s->v3;
+	s->v3 = FUZZYFS_ROTL(s->v3, 21);
+	s->v3 ^= s->v0;
+	s->v2 += s->v1;
+	s->v1 = FUZZYFS_ROTL(s->v1, 17);
+	s->v1 ^= s->v2;
+	s->v2 = FUZZYFS_ROTL(s->v2, 32);
+}
+
+static inline void fuzzyfs_sip_init(struct fuzzyfs_sip *s, const uint64_t key[2])
+{
+	s->v0 = key[0] ^ 0x736f6d6570736575ull;
+	s->v1 = key[1] ^ 0x646f72616e646f6dull;
+	s->v2 = key[0] ^ 0x6c7967656e657261ull;
+	s->v3 = key[1] ^ 0x7465646279746573ull;
+}
+
+static inline void fuzzyfs_sip_block(struct fuzzyfs_sip *s, uint64_t m)
+{
+	s->v3 ^= m;
+	fuzzyfs_sip_round(s);
+	s->v0 ^= m;
+}
+
+/* Hashes the last block m, holding the total length in its top byte. */
+static inline uint64_t fuzzyfs_sip_final(struct fuzzyfs_sip *s, uint64_t m)
+{
+	fuzzyfs_sip_block(s, m);
+	s->v2 ^= 0xff;
+	fuzzyfs_sip_round(s);
+	fuzzyfs_sip_round(s);
+	fuzzyfs_sip_round(s);
+	return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+/* Lowercases the ASCII letters among the 8 bytes of w at once. */
+static inline uint64_t fuzzyfs_fold8(uint64_t w)
+{
+	const uint64_t ones = 0x0101010101010101ull;
+	uint64_t x = w & (ones * 0x7f);
+	uint64_t upper = (x + ones * (0x80 - 'A')) & ~(x + ones * (0x80 - 'Z' - 1)) & ~w;
+
+	return w | (upper & (ones * 0x80)) >> 2;
+}
+
+/* name() of name[0..len). */
+static inline uint64_t fuzzyfs_hash_name(const uint64_t key[2], const char *name, size_t len)
+{
+	struct fuzzyfs_sip s;
+	uint64_t m = 0;
+	size_t i;
+
+	fuzzyfs_sip_init(&s, key);
+	for (i = 0; i + 8 <= len; i += 8)
+	{
+		memcpy(&m, name + i, 8);
+		fuzzyfs_sip_block(&s, fuzzyfs_fold8(le64toh(m)));
+	}
+	for (m = 0; i < len; i++)
+		m |= (uint64_t)(unsigned char)name[i] << (8 * (i & 7));
+	return fuzzyfs_sip_final(&s, fuzzyfs_fold8(m) | (uint64_t)len << 56);
+}
+
+/* join() of the hashes of a directory and a name in it. */
+static inline uint64_t fuzzyfs_hash_join(const uint64_t key[2], uint64_t dir, uint64_t name)
+{
+	struct fuzzyfs_sip s;
+
+	fuzzyfs_sip_init(&s, key);
+	fuzzyfs_sip_block(&s, dir);
+	fuzzyfs_sip_block(&s, name);
+	return fuzzyfs_sip_final(&s, (uint64_t)16 << 56);
+}
+
+/*
+ * Looks up the entry whose path hashes to hash in layer, copying
+ * its real name (at most size - 1 bytes) and a NUL into name.
+ * Returns the name's length, or -1 if it is not in the segment.
+ */
+static inline int fuzzyfs_shm_probe(const struct fuzzyfs_shm *shm, uint64_t hash,
+				    uint32_t layer, char *name, size_t size)
+{
+	const struct fuzzyfs_shm_slot *slots =
+		(const struct fuzzyfs_shm_slot *)((const char *)shm + shm->slots);
+	uint32_t g, s, i, off, len, l;
+	uint64_t h;
+
+	if (!hash)
+		hash = 1;
+again:
+	while ((g = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	for (i = hash & (shm->nslots - 1);; i = (i + 1) & (shm->nslots - 1))
+	{
+		do
+		{
+			while ((s = __atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE)) & 1)
+				;
+			h = __atomic_load_n(&slots[i].hash, __ATOMIC_RELAXED);
+			l = __atomic_load_n(&slots[i].layer, __ATOMIC_RELAXED);
+			off = __atomic_load_n(&slots[i].name, __ATOMIC_RELAXED);
+			len = __atomic_load_n(&slots[i].len, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (__atomic_load_n(&slots[i].seq, __ATOMIC_RELAXED) != s);
+
+		if (!h)
+			break;
+		if (h != hash || l != layer)
+			continue;
+
+		if (len >= size || off + len > shm->names_size)
+			break;
+		memcpy(name, (const char *)shm + shm->names + off, len);
+		name[len] = '\0';
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != g)
+			goto again;
+		return len;
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != g)
+		goto again;
+	return -1;
+}
+
+/*
+ * Corrects the case of path (relative to the sources, without a leading
+ * slash) in layer as far as the segment knows it, into out. Components
+ * it knows nothing about are copied as they are, so the result must
+ * still be checked with a stat() before trusting it.
+ * Returns 0, or -1 if out is too small.
+ */
+static inline int fuzzyfs_shm_lookup(const struct fuzzyfs_shm *shm, const char *path,
+				     uint32_t layer, char *out, size_t size)
+{
+	uint64_t h = 0;
+	size_t start = 0, end, len = strlen(path);
+	char name[256];
+
+	if (len >= size)
+		return -1;
+	memcpy(out, path, len + 1);
+
+	while (start < len)
+	{
+		for (end = start; end < len && path[end] != '/'; end++)
+			;
+		if (end > start)
+		{
+			h = fuzzyfs_hash_join(shm->key, h,
+					      fuzzyfs_hash_name(shm->key, path + start, end - start));
+			if (fuzzyfs_shm_probe(shm, h, layer, name, sizeof(name)) == (int)(end - start))
+				memcpy(out + start, name, end - start);
+		}
+		start = end + 1;
+	}
+	return 0;
+}
+
+#endif /* FUZZYFS_SHM_H */
@@ -0,0 +1,298 @@
+/*
+ * fuzzyfs: Case-insensitive FUSE file system
+ * Copyright (C) 2020  Joel Puig Rubio <joel.puig.rubio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks of the hashes and directory indexes of fuzzyfs, built in
+ * like the tests are. Run with "make bench", or as
+ *
+ *   tests/bench [names]
+ *
+ * to index a directory of that many names (200000 by default) made up
+ * under /tmp. It reports:
+ *
+ * - the cost of hashing a name with the keyed SipHash-1-3 of
+ *   fuzzyfs_shm.h, against the unkeyed FNV-1a it replaced;
+ * - the size of each kind of index of the directory, and the cost of
+ *   a lookup that hits or misses in it;
+ * - the cost of a lookup in the table index with huge_pages off and on,
+ *   with the dTLB load misses counted by perf_event_open(2), or "n/a"
+ *   where the kernel or the hardware does not count them.
+ */
+
+#define main fuzzyfs_main
+#include "../fuzzyfs.c"
+#undef main
+
+#include <ctype.h>
+#include <ftw.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+#define LOOKUPS		2000000
+
+static char scratch[] = "/tmp/fuzzyfs-bench.XXXXXX";
+static volatile uint64_t sink;		// keeps results from being optimized out
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(2);
+}
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - start->tv_sec) * 1e9 + (ts.tv_nsec - start->tv_nsec);
+}
+
+// How names were hashed before they were keyed.
+static unsigned int fnv_fold(const char *s, size_t len)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		h ^= tolower((unsigned char)s[i]);
+		h *= 16777619;
+	}
+	return h;
+}
+
+static void bench_hash(void)
+{
+	static const char *names[] = {
+		"a", "x.css", "index.php", "IMG_20240101_123456.jpg",
+		"Some_Quite_Long_Directory_Name",
+	};
+	struct timespec start;
+	struct tokens ts;
+	unsigned int i, r;
+	double fnv, sip;
+	volatile size_t len;		// read again for each hash
+
+	printf("hashing, ns per name\n");
+	printf("  %-35s %8s %12s\n", "name (length)", "FNV-1a", "SipHash-1-3");
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+	{
+		len = strlen(names[i]);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (r = 0; r < LOOKUPS; r++)
+			sink += fnv_fold(names[i], len);
+		fnv = elapsed(&start) / LOOKUPS;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (r = 0; r < LOOKUPS; r++)
+			sink += name_hash(names[i], len);
+		sip = elapsed(&start) / LOOKUPS;
+		printf("  %-30s (%2zu) %8.1f %12.1f\n", names[i], len, fnv, sip);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < LOOKUPS / 10; r++)
+	{
+		if (!tokenize("var/www/Site/images/Logo.png", &ts))
+			fail("tokenize");
+		sink += ts.hash;
+		tokens_free(&ts);
+	}
+	printf("  tokenizing a path of 5 components: %.1f ns\n\n", elapsed(&start) / (LOOKUPS / 10));
+}
+
+/*
+ * Indexes the directory "big" of t into a part of the given kind: 0 for
+ * a table, 1 for a minimal perfect hash and 2 for front coded names.
+ */
+static struct dindex *build(struct tree *t, int kind)
+{
+	char path[PATH_MAX];
+	struct dindex *idx;
+	struct stat s;
+	DIR *dp;
+
+	if (!(idx = calloc(1, sizeof(*idx))))
+		return NULL;
+	idx->refs = 1;
+	snprintf(path, sizeof(path), "%s/big", t->layers[0].path);
+	if (!(dp = opendir(path)) || fstat(dirfd(dp), &s) == -1 ||
+	    !(idx->part[0] = dpart_scan(dp, &s)))
+		fail(path);
+	closedir(dp);
+	if (kind == 1)
+		dpart_compact(idx->part[0]);
+	else if (kind == 2)
+		dpart_compress(idx->part[0]);
+	idx->layers = 1;
+	return idx;
+}
+
+// Returns the mean time of a lookup of the names in order, in ns.
+static double bench_lookups(const struct dindex *idx, char (*names)[32], const uint64_t *hashes,
+			    unsigned int count)
+{
+	static struct dindex_match m;
+	struct timespec start;
+	unsigned int r, i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < LOOKUPS; r++)
+	{
+		i = r % count;
+		sink += dindex_lookup(idx, names[i], strlen(names[i]), hashes[i], &m);
+	}
+	return elapsed(&start) / LOOKUPS;
+}
+
+static void bench_index(struct tree *t, char (*hits)[32], const uint64_t *hit_hashes,
+			char (*misses)[32], const uint64_t *miss_hashes, unsigned int count)
+{
+	static const char *kinds[] = { "table", "mph", "front coded" };
+	struct dindex *idx;
+	unsigned int q;
+
+	printf("index of %u names\n", count);
+	printf("  %-12s %12s %11s %9s %9s\n", "kind", "bytes", "bytes/name", "hit ns", "miss ns");
+	for (q = 0; q < 3; q++)
+	{
+		if (!(idx = build(t, q)))
+			fail("dindex_build");
+		printf("  %-12s %12zu %11.1f %9.1f %9.1f\n", kinds[q], idx->part[0]->bytes,
+		       (double)idx->part[0]->bytes / count,
+		       bench_lookups(idx, hits, hit_hashes, count),
+		       bench_lookups(idx, misses, miss_hashes, count));
+		dindex_put(idx);
+	}
+	printf("\n");
+}
+
+// Opens a counter of the dTLB load misses of this thread, or returns -1.
+static int dtlb_open(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void bench_huge_pages(struct tree *t, char (*hits)[32], const uint64_t *hit_hashes,
+			     unsigned int count)
+{
+	struct dindex *idx;
+	long long misses;
+	unsigned int huge = conf.huge_pages;
+	int fd = dtlb_open();
+	double ns;
+	char tlb[32];
+
+	printf("table index lookups by huge_pages\n");
+	printf("  %-12s %9s %20s\n", "huge_pages", "hit ns", "dTLB misses/lookup");
+	for (conf.huge_pages = 0; conf.huge_pages < 2; conf.huge_pages++)
+	{
+		if (!(idx = build(t, 0)))
+			fail("dindex_build");
+		if (fd != -1)
+		{
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+		ns = bench_lookups(idx, hits, hit_hashes, count);
+		if (fd != -1)
+			ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (fd != -1 && read(fd, &misses, sizeof(misses)) == sizeof(misses))
+			snprintf(tlb, sizeof(tlb), "%.3f", (double)misses / LOOKUPS);
+		else
+			strcpy(tlb, "n/a");
+		printf("  %-12u %9.1f %20s\n", conf.huge_pages, ns, tlb);
+		dindex_put(idx);
+	}
+	conf.huge_pages = huge;
+	if (fd != -1)
+		close(fd);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+
+	return remove(path);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000, i, k;
+	char path[PATH_MAX], (*hits)[32], (*misses)[32];
+	uint64_t *hit_hashes, *miss_hashes;
+	struct tree *t;
+	int fd;
+
+	if (!count)
+	{
+		fprintf(stderr, "usage: %s [names]\n", argv[0]);
+		return 2;
+	}
+	if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key))
+		fail("getrandom");
+	log_prio = LOG_WARNING;
+	bench_hash();
+
+	if (!mkdtemp(scratch))
+		fail(scratch);
+	snprintf(path, sizeof(path), "%s/big", scratch);
+	if (mkdir(path, 0755) == -1)
+		fail(path);
+	for (i = 0; i < count; i++)
+	{
+		snprintf(path, sizeof(path), "%s/big/IMG_20240101_%07u.jpg", scratch, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1)
+			fail(path);
+		close(fd);
+	}
+	t = tree_get(argv[0], scratch, NULL, NULL);
+
+	// looked up in another case, in an order that defeats the caches
+	hits = malloc(count * sizeof(*hits));
+	misses = malloc(count * sizeof(*misses));
+	hit_hashes = malloc(count * sizeof(*hit_hashes));
+	miss_hashes = malloc(count * sizeof(*miss_hashes));
+	if (!hits || !misses || !hit_hashes || !miss_hashes)
+		fail("malloc");
+	for (i = 0; i < count; i++)
+	{
+		k = (unsigned int)((i * 2654435761ull) % count);
+		snprintf(hits[i], sizeof(hits[i]), "img_20240101_%07u.JPG", k);
+		hit_hashes[i] = name_hash(hits[i], strlen(hits[i]));
+		snprintf(misses[i], sizeof(misses[i]), "img_20240101_%07u.png", k);
+		miss_hashes[i] = name_hash(misses[i], strlen(misses[i]));
+	}
+
+	bench_index(t, hits, hit_hashes, misses, miss_hashes, count);
+	bench_huge_pages(t, hits, hit_hashes, count);
+
+	nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
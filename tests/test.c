@@ -0,0 +1,1509 @@
+/*
+ * fuzzyfs: Case-insensitive FUSE file system
+ * Copyright (C) 2020  Joel Puig Rubio <joel.puig.rubio@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Behavior tests of the hashes, directory indexes and caches of fuzzyfs,
+ * and of the reader protocol of fuzzyfs_shm.h. fuzzyfs.c is built in, so
+ * that its internals are called directly on source directories made up
+ * under a temporary directory: nothing is mounted, and no FUSE request
+ * is made. Run with "make test".
+ */
+
+#define main fuzzyfs_main
+#include "../fuzzyfs.c"
+#undef main
+
+#include <ftw.h>
+#include <poll.h>
+#include <stdarg.h>
+
+static char scratch[] = "/tmp/fuzzyfs-test.XXXXXX";
+static const char *current;		// name of the test running
+static int failures;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__, current, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(2);
+}
+
+/*
+ * Creates the file path under the scratch directory, and the directories
+ * leading to it. With a trailing slash, path is a directory.
+ */
+static void create(const char *fmt, ...)
+{
+	char path[PATH_MAX], *p;
+	va_list ap;
+	size_t len;
+	int fd;
+
+	len = snprintf(path, sizeof(path), "%s/", scratch);
+	va_start(ap, fmt);
+	vsnprintf(path + len, sizeof(path) - len, fmt, ap);
+	va_end(ap);
+
+	for (p = path + len; (p = strchr(p, '/')) != NULL; p++)
+	{
+		*p = '\0';
+		if (mkdir(path, 0755) == -1 && errno != EEXIST)
+			fail(path);
+		*p = '/';
+	}
+	if (path[strlen(path) - 1] != '/' &&
+	    ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1 || close(fd) == -1))
+		fail(path);
+}
+
+// The tree of the source directories dirs, relative to the scratch directory.
+static struct tree *tree_of(const char *dirs, const char *shm_index)
+{
+	char list[4096], *copy, *dir, *saveptr;
+	size_t len = 0;
+
+	if (!(copy = strdup(dirs)))
+		fail("strdup");
+	for (dir = strtok_r(copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr))
+		len += snprintf(list + len, sizeof(list) - len, "%s%s/%s", len ? ":" : "", scratch, dir);
+	free(copy);
+	return tree_get("test", list, NULL, shm_index);
+}
+
+// Indexes the directory dir of t in all of its layers.
+static struct dindex *build(struct tree *t, const char *dir)
+{
+	static char real[PATH_MAX];
+	struct walk w;
+	unsigned int l;
+
+	strcpy(real, dir);
+	w.t = t;
+	w.live = (1u << t->nlayers) - 1;
+	w.base = 0;
+	w.open = NULL;
+	for (l = 0; l < t->nlayers; l++)
+		w.real[l] = real;
+	return dindex_build(&w, strlen(dir), 0);
+}
+
+/*
+ * Indexes the directory dir of t in all of its layers into parts of the
+ * given kind: 0 for tables, 1 for minimal perfect hashes and 2 for front
+ * coded names. They aren't shared, so that kinds can be compared.
+ */
+static struct dindex *build_kind(struct tree *t, const char *dir, int kind)
+{
+	char path[PATH_MAX];
+	struct dindex *idx;
+	struct stat s;
+	unsigned int l;
+	DIR *dp;
+
+	if (!(idx = calloc(1, sizeof(*idx))))
+		fail("calloc");
+	idx->refs = 1;
+	for (l = 0; l < t->nlayers; l++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", t->layers[l].path, dir);
+		if (!(dp = opendir(path)) || fstat(dirfd(dp), &s) == -1 ||
+		    !(idx->part[l] = dpart_scan(dp, &s)))
+			fail(path);
+		closedir(dp);
+		if (kind == 1)
+			dpart_compact(idx->part[l]);
+		else if (kind == 2)
+			dpart_compress(idx->part[l]);
+		idx->layers |= 1u << l;
+	}
+	return idx;
+}
+
+static int lookup(const struct dindex *idx, const char *name, struct dindex_match *m)
+{
+	return dindex_lookup(idx, name, strlen(name), name_hash(name, strlen(name)), m);
+}
+
+// Tells whether the spellings of m are those of want, "layer:name" each.
+static int match_is(const struct dindex_match *m, unsigned int count, ...)
+{
+	char buf[NAME_MAX + 16];
+	va_list ap;
+	unsigned int k;
+	int res = m->count == count;
+
+	va_start(ap, count);
+	for (k = 0; k < count && res; k++)
+	{
+		snprintf(buf, sizeof(buf), "%u:%s", m->layer[k], m->name[k]);
+		res = !strcmp(buf, va_arg(ap, const char *));
+	}
+	va_end(ap);
+	return res;
+}
+
+// Returns the result of fix_path_case() in layer:path form, in buf.
+static const char *correct(struct tree *t, const char *path, char *buf, size_t size)
+{
+	char *p;
+	int layer;
+
+	if (!(p = fix_path_case(t, path, &layer)))
+		return "-";
+	snprintf(buf, size, "%d:%s", layer, p);
+	free(p);
+	return buf;
+}
+
+/*
+ * SipHash-1-3 as specified, a byte at a time, against which the hashes
+ * of fuzzyfs_shm.h are checked.
+ */
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND \
+	do \
+	{ \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+static uint64_t siphash13(const uint64_t key[2], const unsigned char *in, size_t len)
+{
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ull, v1 = key[1] ^ 0x646f72616e646f6dull;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ull, v3 = key[1] ^ 0x7465646279746573ull;
+	uint64_t m = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+	{
+		m |= (uint64_t)in[i] << (8 * (i % 8));
+		if (i % 8 == 7)
+		{
+			v3 ^= m;
+			SIPROUND;
+			v0 ^= m;
+			m = 0;
+		}
+	}
+	m |= (uint64_t)(len & 0xff) << 56;
+	v3 ^= m;
+	SIPROUND;
+	v0 ^= m;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static void test_hash(void)
+{
+	unsigned char name[64], folded[64], le[16];
+	uint64_t other[2] = { hash_key[0] ^ 1, hash_key[1] }, w, f;
+	unsigned int i, n, c;
+	size_t len;
+
+	// every byte value in every position of a word, and every tail length
+	for (n = 0; n < 4000; n++)
+	{
+		len = n % 41;
+		for (i = 0; i < len; i++)
+		{
+			name[i] = (n * 131 + i * 71 + (i == n % 8 ? n / 8 : 0)) & 0xff;
+			folded[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 'a' - 'A' : name[i];
+		}
+		CHECK(fuzzyfs_hash_name(hash_key, (char *)name, len) == siphash13(hash_key, folded, len));
+	}
+	for (c = 0; c < 256; c++)
+	{
+		memset(name, c, 8);
+		memset(folded, c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c, 8);
+		memcpy(&w, name, 8);
+		memcpy(&f, folded, 8);
+		CHECK(fuzzyfs_fold8(w) == f);
+	}
+
+	// names differing in case only collide, under another key too
+	CHECK(name_hash("Index.PHP", 9) == name_hash("index.php", 9));
+	CHECK(name_hash("\xc1", 1) != name_hash("\xe1", 1));
+	CHECK(fuzzyfs_hash_name(other, "index.php", 9) != name_hash("index.php", 9));
+	CHECK(fuzzyfs_hash_name(other, "Index.PHP", 9) == fuzzyfs_hash_name(other, "index.php", 9));
+
+	// join is SipHash of the two hashes, little endian, from 0 for ""
+	for (i = 0; i < 8; i++)
+	{
+		le[i] = 0;
+		le[8 + i] = name_hash("dir", 3) >> (8 * i);
+	}
+	w = siphash13(hash_key, le, 16);
+	CHECK(path_hash64("dir", 3) == w);
+	for (i = 0; i < 8; i++)
+	{
+		le[i] = w >> (8 * i);
+		le[8 + i] = name_hash("name", 4) >> (8 * i);
+	}
+	CHECK(path_hash64("dir/name", 8) == siphash13(hash_key, le, 16));
+	CHECK(path_hash64("", 0) == 0);
+	CHECK(path_hash64("/a//B/", 6) == path_hash64("A/b", 3));
+	CHECK(path_hash64("a/b", 3) != path_hash64("b/a", 3));
+	CHECK(path_hash64("ab", 2) != path_hash64("a/b", 3));
+}
+
+/*
+ * Paths are split into their components in place, however many slashes
+ * separate them, and however many there are. The hash of each prefix is
+ * the path_hash() of that prefix.
+ */
+static void test_tokens(void)
+{
+	const char *path = "/Var//www/Site/";
+	char many[512];
+	struct tokens ts;
+	unsigned int i;
+
+	if (!tokenize(path, &ts))
+		fail("tokenize");
+	CHECK(ts.count == 3 && ts.tk == ts.local);
+	CHECK(ts.tk[0].start == 1 && ts.tk[0].end == 4);
+	CHECK(ts.tk[1].start == 6 && ts.tk[1].end == 9);
+	CHECK(ts.tk[2].start == 10 && ts.tk[2].end == 14);
+	CHECK(ts.tk[2].hash == name_hash("site", 4));
+	for (i = 0; i < ts.count; i++)
+		CHECK(ts.tk[i].prefix == path_hash(path, ts.tk[i].end));
+	CHECK(ts.hash == path_hash("var/WWW/site", 12));
+	tokens_free(&ts);
+
+	if (!tokenize("//", &ts))
+		fail("tokenize");
+	CHECK(ts.count == 0);
+	tokens_free(&ts);
+
+	for (i = 0; i < 100; i++)
+		memcpy(many + 2 * i, "a/", 3);
+	if (!tokenize(many, &ts))
+		fail("tokenize");
+	CHECK(ts.count == 100 && ts.tk != ts.local);
+	CHECK(ts.tk[99].start == 198 && ts.tk[99].end == 199);
+	CHECK(ts.hash == path_hash(many, 200) && ts.tk[49].prefix == path_hash(many, 99));
+	tokens_free(&ts);
+}
+
+/*
+ * Every kind of index answers the same: each spelling of a name in every
+ * layer, highest priority first, the winner of a collision in a layer
+ * being the lowest in strcmp() order with collision=lexical.
+ */
+static void test_index(void)
+{
+	static const char *kinds[] = { "table", "mph", "front coded" };
+	struct dindex_match m, e;
+	struct dindex *idx[3];
+	struct tree *t;
+	char name[64];
+	unsigned int i, k, q, names;
+
+	for (i = 0; i < 3000; i++)
+	{
+		if (i % 2 == 0)
+			create("index/upper/big/IMG_2024_%05u.jpg", i);
+		create("index/lower/big/img_2024_%05u.JPG", i);
+	}
+	create("index/upper/big/Logo.png");
+	create("index/upper/big/LOGO.png");
+	create("index/lower/big/logo.PNG");
+	create("index/lower/big/only-lower.txt");
+	create("index/lower/big/a");
+	t = tree_of("index/upper:index/lower", NULL);
+	collision = COLLISION_LEXICAL;
+
+	for (q = 0; q < 3; q++)
+		idx[q] = build_kind(t, "big", q);
+	CHECK(!idx[0]->part[0]->mph && !idx[0]->part[0]->blocks);
+	CHECK(idx[1]->part[0]->mph != NULL && idx[1]->part[1]->mph != NULL);
+	CHECK(idx[2]->part[0]->blocks != NULL && idx[2]->part[1]->blocks != NULL);
+
+	for (q = 0; q < 3; q++)
+	{
+		current = kinds[q];
+		CHECK(lookup(idx[q], "logo.png", &m) &&
+		      match_is(&m, 2, "0:LOGO.png", "1:logo.PNG"));
+		CHECK(lookup(idx[q], "ONLY-LOWER.TXT", &m) &&
+		      match_is(&m, 1, "1:only-lower.txt"));
+		CHECK(lookup(idx[q], "A", &m) && match_is(&m, 1, "1:a"));
+		CHECK(lookup(idx[q], "img_2024_00002.jpg", &m) &&
+		      match_is(&m, 2, "0:IMG_2024_00002.jpg", "1:img_2024_00002.JPG"));
+		CHECK(lookup(idx[q], "Img_2024_02999.Jpg", &m) &&
+		      match_is(&m, 1, "1:img_2024_02999.JPG"));
+
+		for (i = 0; i < 3000; i++)
+		{
+			snprintf(name, sizeof(name), "iMg_2024_%05u.jPg", i);
+			CHECK(lookup(idx[q], name, &m) && m.count == 2 - i % 2);
+			CHECK(lookup(idx[0], name, &e) && m.count == e.count &&
+			      !strcmp(m.name[0], e.name[0]) && m.layer[0] == e.layer[0]);
+			snprintf(name, sizeof(name), "img_2024_%05u.jp", i);
+			CHECK(!lookup(idx[q], name, &m));
+			snprintf(name, sizeof(name), "img_2024_%05u.jpgx", i);
+			CHECK(!lookup(idx[q], name, &m));
+		}
+		CHECK(!lookup(idx[q], "", &m));
+		CHECK(!lookup(idx[q], "b", &m));
+		CHECK(!lookup(idx[q], "zzz", &m));
+		CHECK(!lookup(idx[q], "logo.pn", &m));
+
+		// iterating lists every name once
+		for (i = names = 0; i < dindex_size(idx[q]); i++)
+			if (dindex_entry(idx[q], i, &m))
+			{
+				names++;
+				for (k = 1; k < m.count; k++)
+					CHECK(m.layer[k - 1] < m.layer[k]);
+			}
+		CHECK(names == 3000 + 3);
+	}
+	for (q = 0; q < 3; q++)
+		dindex_put(idx[q]);
+	collision = COLLISION_EXACT;
+}
+
+/*
+ * Of names differing only in case, collision=exact takes the requested
+ * one if there is one and the first found otherwise, lexical the lowest
+ * in byte order and newest the most recently modified. Scans and indexes
+ * agree.
+ */
+static void test_collision(void)
+{
+	static const char *names[] = { "Logo.png", "LOGO.png", "logo.PNG" };
+	static const time_t mtimes[] = { 3000, 1000, 2000 };
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { 0, 0 } };
+	struct dirent *de;
+	struct tree *t;
+	char path[PATH_MAX], buf[256], want[256], first[NAME_MAX + 1] = "";
+	unsigned long hits;
+	unsigned int i, k;
+	DIR *dp;
+
+	for (i = 0; i < 3; i++)
+	{
+		for (k = 0; k < 3; k++)
+		{
+			create("collision/%s/%s", collision_names[i], names[k]);
+			snprintf(path, sizeof(path), "%s/collision/%s/%s", scratch, collision_names[i],
+				 names[k]);
+			times[1].tv_sec = mtimes[k];
+			if (utimensat(AT_FDCWD, path, times, 0) == -1)
+				fail(path);
+		}
+		for (k = 0; k < 100; k++)
+			create("collision/%s/other%u", collision_names[i], k);
+	}
+	snprintf(path, sizeof(path), "%s/collision/exact", scratch);
+	if (!(dp = opendir(path)))
+		fail(path);
+	while (!first[0] && (de = readdir(dp)) != NULL)
+		if (!strcasecmp(de->d_name, "logo.png"))
+			strcpy(first, de->d_name);
+	closedir(dp);
+	t = tree_of("collision", NULL);
+
+	for (i = 0; i < 3; i++)
+	{
+		collision = i;
+		current = collision_names[i];
+		snprintf(want, sizeof(want), "0:%s/%s", collision_names[i],
+			 i == COLLISION_EXACT ? first : i == COLLISION_LEXICAL ? "LOGO.png" : "Logo.png");
+		snprintf(path, sizeof(path), "%s/lOgO.pNg", collision_names[i]);
+
+		// scanned until the directory is indexed, under exact
+		hits = t->stats.index_hits;
+		for (k = 0; k < 6; k++)
+		{
+			CHECK(!strcmp(correct(t, path, buf, sizeof(buf)), want));
+			pcache_remove(&t->pcache, path, path_hash(path, strlen(path)));
+		}
+		CHECK(t->stats.index_hits > hits);
+	}
+	collision = COLLISION_EXACT;
+	current = "collision";
+	CHECK(!strcmp(correct(t, "exact/LOGO.png", buf, sizeof(buf)), "0:exact/LOGO.png"));
+}
+
+/*
+ * Trees with a source in common share its part of their indexes: it is
+ * read and charged to mem_used once, until it changes.
+ */
+static void test_shared(void)
+{
+	struct dindex *a, *b, *c, *d;
+	struct dindex_match m;
+	struct stat st;
+	struct tree *one, *two;
+	struct timespec times[2] = { { 1, 0 }, { 1, 0 } };
+	char path[PATH_MAX];
+	size_t mem;
+
+	create("shared/one/d/Over.txt");
+	create("shared/two/d/other.txt");
+	create("shared/common/d/Common.txt");
+	one = tree_of("shared/one:shared/common", NULL);
+	two = tree_of("shared/two:shared/common", NULL);
+	CHECK(one != two);
+
+	mem = mem_used;
+	if (!(a = build(one, "d")))
+		fail("dindex_build");
+	CHECK(one->stats.builds == 2);
+	CHECK(mem_used == mem + a->bytes + a->part[0]->bytes + a->part[1]->bytes);
+	if (!(b = build(two, "d")))
+		fail("dindex_build");
+	CHECK(two->stats.builds == 1);
+	CHECK(b->part[1] == a->part[1]);
+	CHECK(mem_used == mem + a->bytes + b->bytes + a->part[0]->bytes + b->part[0]->bytes +
+			  a->part[1]->bytes);
+	CHECK(lookup(b, "COMMON.TXT", &m) && match_is(&m, 1, "1:Common.txt"));
+	CHECK(lookup(b, "OTHER.txt", &m) && match_is(&m, 1, "0:other.txt"));
+	CHECK(!lookup(b, "over.txt", &m));
+
+	// a change is read again, and shared from then on
+	create("shared/common/d/New.txt");
+	snprintf(path, sizeof(path), "%s/shared/common/d", scratch);
+	if (utimensat(AT_FDCWD, path, times, 0) == -1)
+		fail(path);
+	if (!(c = build(one, "d")))
+		fail("dindex_build");
+	CHECK(one->stats.builds == 3);
+	CHECK(c->part[0] == a->part[0] && c->part[1] != a->part[1]);
+	CHECK(lookup(c, "new.txt", &m) && match_is(&m, 1, "1:New.txt"));
+	CHECK(!lookup(b, "new.txt", &m));
+	if (!(d = build(two, "d")))
+		fail("dindex_build");
+	CHECK(two->stats.builds == 1);
+	CHECK(d->part[0] == b->part[0] && d->part[1] == c->part[1]);
+
+	// and forgotten with the last index using it
+	dindex_put(a);
+	dindex_put(b);
+	dindex_put(c);
+	dindex_put(d);
+	CHECK(mem_used == mem);
+	if (stat(path, &st) == -1)
+		fail(path);
+	CHECK(!dpart_find(&st));
+}
+
+// Opens the directory dir in every layer of t as h, with an index of it if index.
+static void open_dir(struct tree *t, const char *dir, int index, struct dir_handle *h)
+{
+	char path[PATH_MAX];
+	unsigned int l;
+
+	memset(h, 0, sizeof(*h));
+	for (l = 0; l < t->nlayers; l++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", t->layers[l].path, dir);
+		if (!(h->dp[l] = opendir(path)))
+			fail(path);
+		h->layer[l] = l;
+		h->count++;
+	}
+	if (index && !(h->index = build(t, dir)))
+		fail("dindex_build");
+}
+
+static void close_dir(struct dir_handle *h)
+{
+	unsigned int i;
+
+	for (i = 0; i < h->count; i++)
+		closedir(h->dp[i]);
+	if (h->index)
+		dindex_put(h->index);
+}
+
+// How many times ls lists name.
+static unsigned int listed(const struct dlisting *ls, const char *name)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < ls->count; i++)
+		count += !strcmp(ls->names + ls->ents[i].name, name);
+	return count;
+}
+
+// Takes entries until it has had limit of them.
+static int take(void *ctx, const char *name, ino_t ino, unsigned char type)
+{
+	unsigned int *left = ctx;
+
+	(void) name;
+	(void) ino;
+	(void) type;
+	return (*left)-- <= 1;
+}
+
+/*
+ * A snapshot lists each name once for the highest priority layer that
+ * has it, and each spelling within that layer unless an index picks
+ * one, the lowest with collision=lexical. One that can't take every entry is not taken at all.
+ */
+static void test_listing(void)
+{
+	struct dir_handle h;
+	struct dlisting *ls;
+	struct tree *t;
+	unsigned int i, left;
+
+	create("listing/over/d/Logo.png");
+	create("listing/over/d/a.txt");
+	create("listing/under/d/logo.PNG");
+	create("listing/under/d/A.TXT");
+	create("listing/under/d/b.txt");
+	create("listing/under/d/B.txt");
+	// more than the set of names seen starts with
+	for (i = 0; i < 3000; i++)
+		create("listing/under/d/c%u", i);
+	t = tree_of("listing/over:listing/under", NULL);
+
+	open_dir(t, "d", FALSE, &h);
+	if (!(ls = dlisting_take(&h)))
+		fail("dlisting_take");
+	// "." and ".." too, once
+	CHECK(ls->count == 2 + 2 + 2 + 3000 && !ls->hidden);
+	CHECK(listed(ls, ".") == 1 && listed(ls, "..") == 1);
+	CHECK(listed(ls, "Logo.png") == 1 && listed(ls, "logo.PNG") == 0);
+	CHECK(listed(ls, "a.txt") == 1 && listed(ls, "A.TXT") == 0);
+	CHECK(listed(ls, "b.txt") == 1 && listed(ls, "B.txt") == 1);
+	CHECK(listed(ls, "c0") == 1 && listed(ls, "c2999") == 1);
+	dlisting_put(ls);
+	close_dir(&h);
+
+	collision = COLLISION_LEXICAL;
+	open_dir(t, "d", TRUE, &h);
+	if (!(ls = dlisting_take(&h)))
+		fail("dlisting_take");
+	CHECK(ls->count == 2 + 2 + 1 + 3000 && ls->hidden);
+	CHECK(listed(ls, "Logo.png") == 1 && listed(ls, "a.txt") == 1);
+	CHECK(listed(ls, "B.txt") == 1 && listed(ls, "b.txt") == 0);
+	dlisting_put(ls);
+	close_dir(&h);
+	collision = COLLISION_EXACT;
+
+	// nothing more is read once emitting failed
+	for (i = 0; i < 2; i++)
+	{
+		open_dir(t, "d", i, &h);
+		left = 3;
+		CHECK(dir_read(&h, take, &left) == -ENOMEM);
+		CHECK(left == 0);
+		close_dir(&h);
+	}
+}
+
+/*
+ * A filter never rules out a name it was built of, and rules out most
+ * others. Lookups in a directory it covers need no scan for names it
+ * rules out, until the directory changes.
+ */
+static void test_filter(void)
+{
+	unsigned int hashes[1000], i, maybe = 0;
+	unsigned long scans, hits;
+	struct dfilter *f;
+	struct stat st;
+	struct tree *t;
+	char buf[256];
+
+	for (i = 0; i < 1000; i++)
+	{
+		snprintf(buf, sizeof(buf), "name%u.txt", i);
+		hashes[i] = name_hash(buf, strlen(buf));
+	}
+	memset(&st, 0, sizeof(st));
+	if (!(f = dfilter_build(hashes, 1000, &st)))
+		fail("dfilter_build");
+	for (i = 0; i < 1000; i++)
+		CHECK(dfilter_test(f, hashes[i]));
+	for (i = 0; i < 10000; i++)
+	{
+		snprintf(buf, sizeof(buf), "other%u.txt", i);
+		maybe += dfilter_test(f, name_hash(buf, strlen(buf)));
+	}
+	CHECK(maybe < 300);
+	dfilter_put(f);
+
+	for (i = 0; i < 50; i++)
+		create("filter/big/File%02u.txt", i);
+	t = tree_of("filter", NULL);
+	conf.filter_min = 20;
+	CHECK(!strcmp(correct(t, "big/file07.TXT", buf, sizeof(buf)), "0:big/File07.txt"));
+	scans = t->stats.scans;
+	hits = t->stats.filter_hits;
+	CHECK(!strcmp(correct(t, "big/missing.txt", buf, sizeof(buf)), "-"));
+	CHECK(t->stats.scans == scans && t->stats.filter_hits == hits + 1);
+	CHECK(!strcmp(correct(t, "BIG/FILE42.TXT", buf, sizeof(buf)), "0:big/File42.txt"));
+
+	// a name created since is looked for again
+	create("filter/big/Missing.txt");
+	CHECK(!strcmp(correct(t, "big/missing.txt", buf, sizeof(buf)), "0:big/Missing.txt"));
+	conf.filter_min = 0;
+}
+
+/*
+ * The segment is ours alone and laid out as fuzzyfs_shm.h says, and a
+ * reader corrects paths in every layer from it.
+ */
+static void test_shm(void)
+{
+	const struct fuzzyfs_shm *shm;
+	struct stat st;
+	struct tree *t;
+	char name[64], out[256], buf[256];
+	int fd;
+
+	current = "shm";
+	snprintf(name, sizeof(name), "/fuzzyfs-test-%d", (int)getpid());
+	// one left over, by anyone, is not reused
+	if ((fd = shm_open(name, O_RDWR | O_CREAT, 0666)) == -1 ||
+	    ftruncate(fd, 4096) == -1 || write(fd, "garbage", 7) != 7)
+		fail(name);
+	close(fd);
+
+	create("shm/upper/Images/Logo.png");
+	create("shm/lower/images/logo.PNG");
+	create("shm/lower/images/Sub/File.txt");
+	t = tree_of("shm/upper:shm/lower", name);
+	CHECK(t->shm != NULL);
+	if (!t->shm)
+		return;
+
+	conf.index_threshold = 1;
+	CHECK(!strcmp(correct(t, "IMAGES/LOGO.PNG", buf, sizeof(buf)), "0:Images/Logo.png"));
+	CHECK(!strcmp(correct(t, "images/sub/file.TXT", buf, sizeof(buf)), "1:images/Sub/File.txt"));
+	conf.index_threshold = 4;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1 || fstat(fd, &st) == -1 ||
+	    (shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		fail(name);
+	close(fd);
+	CHECK((st.st_mode & 0777) == 0600);
+	CHECK(st.st_uid == geteuid());
+	CHECK(st.st_size >= 1 << 20);
+	CHECK(shm->magic == FUZZYFS_SHM_MAGIC);
+	CHECK(shm->version == FUZZYFS_SHM_VERSION);
+	CHECK(shm->seq % 2 == 0);
+	CHECK(shm->nlayers == 2);
+	CHECK(!strcmp((const char *)shm + shm->layers, t->layers[0].path));
+	CHECK(!strcmp((const char *)shm + shm->layers + strlen(t->layers[0].path) + 1,
+		      t->layers[1].path));
+	CHECK(shm->key[0] == hash_key[0] && shm->key[1] == hash_key[1]);
+	CHECK(shm->nslots && !(shm->nslots & (shm->nslots - 1)));
+	CHECK(shm->slots % 8 == 0 && shm->slots >= sizeof(*shm));
+	CHECK(shm->names >= shm->slots + shm->nslots * sizeof(struct fuzzyfs_shm_slot));
+	CHECK(shm->names + shm->names_size <= st.st_size);
+	CHECK(shm->names_used > 0 && shm->names_used <= shm->names_size);
+
+	fuzzyfs_shm_lookup(shm, "IMAGES/LOGO.PNG", 0, out, sizeof(out));
+	CHECK(!strcmp(out, "Images/Logo.png"));
+	fuzzyfs_shm_lookup(shm, "IMAGES/LOGO.PNG", 1, out, sizeof(out));
+	CHECK(!strcmp(out, "images/logo.PNG"));
+	fuzzyfs_shm_lookup(shm, "/images//SUB/file.txt", 1, out, sizeof(out));
+	CHECK(!strcmp(out, "/images//Sub/File.txt"));
+	// what it doesn't know is left as it is
+	fuzzyfs_shm_lookup(shm, "images/sub/MISSING", 1, out, sizeof(out));
+	CHECK(!strcmp(out, "images/Sub/MISSING"));
+	fuzzyfs_shm_lookup(shm, "IMAGES/SUB", 0, out, sizeof(out));
+	CHECK(!strcmp(out, "Images/SUB"));
+	CHECK(fuzzyfs_shm_lookup(shm, "images/logo.png", 0, out, 8) == -1);
+	CHECK(fuzzyfs_shm_probe(shm, path_hash64("images/logo.png", 15), 0, out, 4) == -1);
+	CHECK(fuzzyfs_shm_probe(shm, path_hash64("images/logo.png", 15), 1, out, sizeof(out)) == 8 &&
+	      !strcmp(out, "logo.PNG"));
+
+	munmap((void *)shm, st.st_size);
+	shm_unlink(name);
+}
+
+/*
+ * A reader racing the writer as it clears the segment and fills it
+ * again, putting names at other offsets each time, never gets a name
+ * that is not the one of the path it asked for.
+ */
+#define RACE_NAMES	64
+#define RACE_ROUNDS	100000
+#define RACE_READERS	3
+
+static struct
+{
+	const struct fuzzyfs_shm *shm;
+	uint64_t hash[RACE_NAMES];
+	char name[RACE_NAMES][32];
+	int done;
+	unsigned long found, wrong;		// by all readers
+} race;
+
+static void *race_reader(void *arg)
+{
+	char buf[64];
+	unsigned int i = (uintptr_t)arg;
+	unsigned long found = 0, wrong = 0;
+	int len;
+
+	while (!__atomic_load_n(&race.done, __ATOMIC_ACQUIRE))
+	{
+		i = (i + 7) % RACE_NAMES;
+		if ((len = fuzzyfs_shm_probe(race.shm, race.hash[i], 0, buf, sizeof(buf))) == -1)
+			continue;
+		found++;
+		if (len != (int)strlen(race.name[i]) || strcmp(buf, race.name[i]))
+			wrong++;
+	}
+	__atomic_add_fetch(&race.found, found, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&race.wrong, wrong, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+// Probes for the first name of the race, as a reader blocked by the writer.
+static struct
+{
+	char name[64];
+	int len, done;
+} waiter;
+
+static void *wait_reader(void *arg)
+{
+	(void) arg;
+
+	waiter.len = fuzzyfs_shm_probe(race.shm, race.hash[0], 0, waiter.name, sizeof(waiter.name));
+	__atomic_store_n(&waiter.done, TRUE, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Starts a wait_reader() and tells whether it is still waiting a while later.
+static int wait_blocked(pthread_t *th)
+{
+	__atomic_store_n(&waiter.done, FALSE, __ATOMIC_RELEASE);
+	if (pthread_create(th, NULL, wait_reader, NULL))
+		fail("pthread_create");
+	usleep(50000);
+	return !__atomic_load_n(&waiter.done, __ATOMIC_ACQUIRE);
+}
+
+static void test_shm_race(void)
+{
+	struct fuzzyfs_shm_slot *slot;
+	struct shm_index *si;
+	struct stat st;
+	struct tree *t;
+	pthread_t th[RACE_READERS];
+	char name[64];
+	unsigned int i, j, round;
+	int fd;
+
+	current = "shm race";
+	create("race/src/");
+	t = tree_of("race/src", NULL);
+	snprintf(name, sizeof(name), "/fuzzyfs-race-%d", (int)getpid());
+	// the smallest segment, so that clearing it takes little
+	conf.shm_size = 1;
+	if (!(si = shm_create(t, name)))
+		fail(name);
+	conf.shm_size = 16;
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1 || fstat(fd, &st) == -1 ||
+	    (race.shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		fail(name);
+	close(fd);
+
+	for (i = 0; i < RACE_NAMES; i++)
+	{
+		snprintf(race.name[i], sizeof(race.name[i]), "Name-%u%.*s", i, (int)(i % 13), "xxxxxxxxxxxxx");
+		race.hash[i] = path_hash64(race.name[i], strlen(race.name[i]));
+	}
+	for (i = 0; i < RACE_READERS; i++)
+		if (pthread_create(&th[i], NULL, race_reader, (void *)(uintptr_t)i))
+			fail("pthread_create");
+	for (round = 0; round < RACE_ROUNDS; round++)
+	{
+		pthread_mutex_lock(&si->lock);
+		shm_clear(si);
+		for (j = 0; j < RACE_NAMES; j++)
+		{
+			i = (j + round * 31) % RACE_NAMES;
+			CHECK(shm_put(si, race.hash[i], 0, race.name[i], strlen(race.name[i])) == 0);
+		}
+		pthread_mutex_unlock(&si->lock);
+	}
+	__atomic_store_n(&race.done, TRUE, __ATOMIC_RELEASE);
+	for (i = 0; i < RACE_READERS; i++)
+		pthread_join(th[i], NULL);
+	CHECK(race.found > 0);
+	CHECK(race.wrong == 0);
+
+	// and once it is quiet, everything is there
+	for (i = 0; i < RACE_NAMES; i++)
+	{
+		char buf[64];
+
+		CHECK(fuzzyfs_shm_probe(race.shm, race.hash[i], 0, buf, sizeof(buf)) >= 0 &&
+		      !strcmp(buf, race.name[i]));
+		CHECK(fuzzyfs_shm_probe(race.shm, race.hash[i], 1, buf, sizeof(buf)) == -1);
+	}
+
+	// A reader waits while the segment is cleared, and sees what follows.
+	pthread_mutex_lock(&si->lock);
+	__atomic_store_n(&si->shm->seq, si->shm->seq + 1, __ATOMIC_RELEASE);
+	CHECK(wait_blocked(&th[0]));
+	memset(si->slots, 0, si->nslots * sizeof(*si->slots));
+	si->names_used = si->used = 0;
+	shm_put(si, race.hash[0], 0, "Cleared", 7);
+	__atomic_store_n(&si->shm->seq, si->shm->seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&si->lock);
+	pthread_join(th[0], NULL);
+	CHECK(waiter.len == 7 && !strcmp(waiter.name, "Cleared"));
+
+	// and while its slot is written
+	for (i = race.hash[0] & (si->nslots - 1); si->slots[i].hash != race.hash[0]; i = (i + 1) & (si->nslots - 1))
+		;
+	slot = &si->slots[i];
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	CHECK(wait_blocked(&th[0]));
+	__atomic_store_n(&slot->len, 3, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	pthread_join(th[0], NULL);
+	CHECK(waiter.len == 3 && !strcmp(waiter.name, "Cle"));
+
+	munmap((void *)race.shm, st.st_size);
+	shm_unlink(name);
+}
+
+// Waits for the node of dir in t to get another generation than gen.
+static int wait_gen(struct tree *t, const char *dir, unsigned int gen)
+{
+	struct dnode *n;
+	int i, changed = FALSE;
+
+	for (i = 0; i < 200 && !changed; i++)
+	{
+		pthread_mutex_lock(&t->dcache.lock);
+		changed = (n = dcache_find(&t->dcache, dir)) != NULL && n->gen != gen;
+		pthread_mutex_unlock(&t->dcache.lock);
+		if (!changed)
+			usleep(10000);
+	}
+	return changed;
+}
+
+// Returns the generation of the node of dir in t, and whether it is watched and indexed.
+static unsigned int node_gen(struct tree *t, const char *dir, int *watched, int *indexed)
+{
+	struct dnode *n;
+	unsigned int gen = 0;
+
+	*watched = *indexed = FALSE;
+	pthread_mutex_lock(&t->dcache.lock);
+	if ((n = dcache_find(&t->dcache, dir)) != NULL)
+	{
+		gen = n->gen;
+		*watched = n->watched;
+		*indexed = n->index != NULL;
+	}
+	pthread_mutex_unlock(&t->dcache.lock);
+	return gen;
+}
+
+/*
+ * A watched directory is indexed on its first miss and trusted without
+ * a stat until inotify tells of a change, which gives its node a new
+ * generation and drops its index.
+ */
+static void test_generations(void)
+{
+	struct dnode *n;
+	struct tree *t;
+	char kinds[] = "watched", buf[256];
+	unsigned int gen;
+	int watched, indexed;
+
+	current = "generations";
+	create("gen/src/dir/Old.txt");
+	t = tree_of("gen/src", NULL);
+	policy_set(policy_parse(DOT, kinds));
+
+	CHECK(!strcmp(correct(t, "DIR/OLD.TXT", buf, sizeof(buf)), "0:dir/Old.txt"));
+	gen = node_gen(t, "dir", &watched, &indexed);
+	CHECK(gen && watched && indexed);
+	CHECK(!strcmp(correct(t, "dir/NEW.TXT", buf, sizeof(buf)), "-"));
+
+	create("gen/src/dir/New.txt");
+	CHECK(wait_gen(t, "dir", gen));
+	node_gen(t, "dir", &watched, &indexed);
+	CHECK(watched && !indexed);
+	CHECK(!strcmp(correct(t, "dir/NEW.TXT", buf, sizeof(buf)), "0:dir/New.txt"));
+	gen = node_gen(t, "dir", &watched, &indexed);
+	CHECK(watched && indexed);
+
+	// an index of another generation is not used, whatever its stamps say
+	pthread_mutex_lock(&t->dcache.lock);
+	n = dcache_find(&t->dcache, "dir");
+	n->gen = ++t->dcache.gen;
+	CHECK(n->index && n->index->gen != n->gen);
+	pthread_mutex_unlock(&t->dcache.lock);
+	CHECK(!strcmp(correct(t, "dir/missing", buf, sizeof(buf)), "-"));
+	pthread_mutex_lock(&t->dcache.lock);
+	n = dcache_find(&t->dcache, "dir");
+	CHECK(n->index && n->index->gen == n->gen && n->gen != gen);
+	pthread_mutex_unlock(&t->dcache.lock);
+
+	policy_set(NULL);
+}
+
+/*
+ * A directory is only indexed once lookups in it have missed
+ * conf.index_threshold times, and then answers them without a scan.
+ */
+static void test_adaptive_index(void)
+{
+	struct tree *t;
+	char buf[256], name[64], want[64];
+	unsigned long builds, scans;
+	unsigned int i;
+	int watched, indexed;
+
+	for (i = 0; i < 8; i++)
+		create("lazy/src/dir/File%u.txt", i);
+	t = tree_of("lazy/src", NULL);
+	builds = t->stats.builds;
+
+	// distinct names, so that no correction is cached
+	for (i = 0; i < 4; i++)
+	{
+		snprintf(name, sizeof(name), "dir/file%u.TXT", i);
+		snprintf(want, sizeof(want), "0:dir/File%u.txt", i);
+		node_gen(t, "dir", &watched, &indexed);
+		CHECK(!indexed && t->stats.builds == builds);
+		CHECK(!strcmp(correct(t, name, buf, sizeof(buf)), want));
+	}
+	node_gen(t, "dir", &watched, &indexed);
+	CHECK(indexed && t->stats.builds == builds + 1);
+
+	scans = t->stats.scans;
+	CHECK(!strcmp(correct(t, "dir/FILE7.TXT", buf, sizeof(buf)), "0:dir/File7.txt"));
+	CHECK(t->stats.scans == scans);
+}
+
+/*
+ * With cache_timeout_max, directories are trusted for a tenth of the
+ * time since they last changed, up to it, unless a policy says better.
+ */
+static void test_adaptive_ttl(void)
+{
+	struct policy pol;
+	struct dnode *n;
+	struct tree *t;
+	char kinds[] = "ttl=5";
+
+	current = "adaptive ttl";
+	create("adapt/src/dir/");
+	create("adapt/src/fixed/");
+	t = tree_of("adapt/src", NULL);
+	conf.cache_timeout_max = 600;
+
+	pthread_mutex_lock(&t->dcache.lock);
+	n = dcache_get(&t->dcache, "dir", 3, path_hash("dir", 3));
+	dnode_policy(t, n, &pol);
+	CHECK(!(pol.flags & POLICY_TTL));
+
+	n->changed = now() - 1000;
+	dnode_policy(t, n, &pol);
+	CHECK(pol.flags & POLICY_TTL && pol.ttl == 100);
+	CHECK(policy_fresh(&pol, now() - 50));
+	CHECK(!policy_fresh(&pol, now() - 150));
+
+	n->changed = now() - 100000;
+	dnode_policy(t, n, &pol);
+	CHECK(pol.flags & POLICY_TTL && pol.ttl == 600);
+
+	// cache_timeout stays the least
+	conf.cache_timeout = 200;
+	n->changed = now() - 1000;
+	dnode_policy(t, n, &pol);
+	CHECK(!(pol.flags & POLICY_TTL));
+	conf.cache_timeout = 0;
+	pthread_mutex_unlock(&t->dcache.lock);
+
+	// a change starts over
+	watch_changed(&t->dcache, "dir", FALSE);
+	pthread_mutex_lock(&t->dcache.lock);
+	n = dcache_find(&t->dcache, "dir");
+	dnode_policy(t, n, &pol);
+	CHECK(!(pol.flags & POLICY_TTL));
+
+	policy_set(policy_parse("fixed", kinds));
+	n = dcache_get(&t->dcache, "fixed", 5, path_hash("fixed", 5));
+	n->changed = now() - 100000;
+	dnode_policy(t, n, &pol);
+	CHECK(pol.flags & POLICY_TTL && pol.ttl == 5);
+	pthread_mutex_unlock(&t->dcache.lock);
+
+	policy_set(NULL);
+	conf.cache_timeout_max = 0;
+}
+
+/*
+ * A name in a layer of higher priority wins over one in a lower layer,
+ * whichever case they are asked for in.
+ */
+static void test_layers(void)
+{
+	struct stat st;
+	struct tree *t;
+	char buf[256];
+	unsigned long lookups;
+	int i;
+
+	current = "layers";
+	create("layers/over/Logo.png");
+	create("layers/under/logo.png");
+	create("layers/under/only.txt");
+	t = tree_of("layers/over:layers/under", NULL);
+
+	// cached or not, indexed or not
+	for (i = 0; i < 6; i++)
+	{
+		CHECK(!strcmp(correct(t, "logo.png", buf, sizeof(buf)), "0:Logo.png"));
+		CHECK(!strcmp(correct(t, "LOGO.PNG", buf, sizeof(buf)), "0:Logo.png"));
+		CHECK(!strcmp(correct(t, "Only.TXT", buf, sizeof(buf)), "1:only.txt"));
+	}
+	CHECK(find_layer(t, NULL, "Logo.png", &st) == 0);
+	CHECK(find_layer(t, NULL, "only.txt", &st) == 1);
+	CHECK(find_layer(t, NULL, "logo.png", &st) == -1 && errno == ENOENT);
+
+	// exact hits in a lower layer are only walked once
+	create("layers/under/Exact.txt");
+	lookups = t->stats.lookups;
+	for (i = 0; i < 6; i++)
+		CHECK(find_layer(t, NULL, "Exact.txt", &st) == 1);
+	CHECK(t->stats.lookups == lookups + 1);
+
+	// a variant showing up above takes over once the entry is gone
+	create("layers/over/EXACT.txt");
+	pcache_remove(&t->pcache, "Exact.txt", path_hash("Exact.txt", 9));
+	CHECK(find_layer(t, NULL, "Exact.txt", &st) == -1);
+	CHECK(!strcmp(correct(t, "Exact.txt", buf, sizeof(buf)), "0:EXACT.txt"));
+}
+
+/*
+ * Trees of different source lists watching the same directory both
+ * hear of its changes, and forgetting it in one leaves the other's
+ * watch in place.
+ */
+static void test_watch_trees(void)
+{
+	struct tree *a, *b;
+	char kinds[] = "watched", buf[256];
+	unsigned int ga, gb, count, size = conf.cache_size;
+	int watched, indexed;
+
+	current = "watch trees";
+	create("watch/shared/dir/File");
+	create("watch/other/");
+	a = tree_of("watch/shared", NULL);
+	b = tree_of("watch/shared:watch/other", NULL);
+	CHECK(a != b);
+	policy_set(policy_parse(DOT, kinds));
+
+	CHECK(!strcmp(correct(a, "DIR/FILE", buf, sizeof(buf)), "0:dir/File"));
+	CHECK(!strcmp(correct(b, "DIR/FILE", buf, sizeof(buf)), "0:dir/File"));
+	ga = node_gen(a, "dir", &watched, &indexed);
+	CHECK(watched && indexed);
+	gb = node_gen(b, "dir", &watched, &indexed);
+	CHECK(watched && indexed);
+
+	create("watch/shared/dir/Up");
+	CHECK(wait_gen(a, "dir", ga));
+	CHECK(wait_gen(b, "dir", gb));
+	CHECK(!strcmp(correct(a, "dir/up", buf, sizeof(buf)), "0:dir/Up"));
+	CHECK(!strcmp(correct(b, "dir/up", buf, sizeof(buf)), "0:dir/Up"));
+
+	// a's node of dir is evicted
+	pthread_mutex_lock(&watcher.lock);
+	count = watcher.count;
+	pthread_mutex_unlock(&watcher.lock);
+	conf.cache_size = 1;
+	pthread_mutex_lock(&a->dcache.lock);
+	dcache_get(&a->dcache, "elsewhere", 9, path_hash("elsewhere", 9));
+	CHECK(!dcache_find(&a->dcache, "dir"));
+	pthread_mutex_unlock(&a->dcache.lock);
+	conf.cache_size = size;
+	pthread_mutex_lock(&watcher.lock);
+	CHECK(watcher.count < count);
+	pthread_mutex_unlock(&watcher.lock);
+
+	gb = node_gen(b, "dir", &watched, &indexed);
+	create("watch/shared/dir/Again");
+	CHECK(wait_gen(b, "dir", gb));
+	CHECK(!strcmp(correct(b, "DIR/AGAIN", buf, sizeof(buf)), "0:dir/Again"));
+
+	policy_set(NULL);
+}
+
+/*
+ * The warm file lists corrected paths hottest first and brings them back
+ * into an empty cache, even when saves race each other.
+ */
+static void *warm_saver(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 50; i++)
+		warm_save(arg);
+	return NULL;
+}
+
+static void test_warm(void)
+{
+	struct tree *t;
+	pthread_t th;
+	char path[PATH_MAX], line[256], buf[256], *p;
+	unsigned long hits[2];
+	int i, layer, fresh, lines;
+	FILE *f;
+
+	current = "warm file";
+	create("warm/src/Dir/File.txt");
+	create("warm/src/Dir/Other.txt");
+	t = tree_of("warm/src", NULL);
+	snprintf(path, sizeof(path), "%s/warm/paths", scratch);
+	if (!(t->warm_file = strdup(path)))
+		fail("strdup");
+
+	for (i = 0; i < 4; i++)
+		CHECK(!strcmp(correct(t, "dir/file.txt", buf, sizeof(buf)), "0:Dir/File.txt"));
+	CHECK(!strcmp(correct(t, "DIR/OTHER.TXT", buf, sizeof(buf)), "0:Dir/Other.txt"));
+	warm_save(t);
+
+	if (!(f = fopen(path, "r")))
+		fail(path);
+	CHECK(fgets(line, sizeof(line), f) && sscanf(line, "%lu", &hits[0]) == 1 &&
+	      !strcmp(strchr(line, ' '), " dir/file.txt\n"));
+	CHECK(fgets(line, sizeof(line), f) && sscanf(line, "%lu", &hits[1]) == 1 &&
+	      !strcmp(strchr(line, ' '), " DIR/OTHER.TXT\n"));
+	CHECK(hits[0] > hits[1]);
+	CHECK(!fgets(line, sizeof(line), f));
+	fclose(f);
+
+	pcache_remove(&t->pcache, "dir/file.txt", path_hash("dir/file.txt", 12));
+	pcache_remove(&t->pcache, "DIR/OTHER.TXT", path_hash("DIR/OTHER.TXT", 13));
+	warm_load(t);
+	p = pcache_lookup(&t->pcache, "dir/file.txt", path_hash("dir/file.txt", 12), &layer, &fresh);
+	CHECK(p && !strcmp(p, "Dir/File.txt") && layer == 0);
+	free(p);
+	p = pcache_lookup(&t->pcache, "DIR/OTHER.TXT", path_hash("DIR/OTHER.TXT", 13), &layer, &fresh);
+	CHECK(p && !strcmp(p, "Dir/Other.txt"));
+	free(p);
+
+	// the periodic save and an unmount at once, of a bigger cache
+	for (i = 0; i < 2000; i++)
+	{
+		struct policy pol = { 0, 0 };
+
+		snprintf(line, sizeof(line), "dir/%04d/some/longer/path/name.txt", i);
+		pcache_insert(&t->pcache, line, path_hash(line, strlen(line)), line, 0, 1, &pol, NULL);
+	}
+	if (pthread_create(&th, NULL, warm_saver, t))
+		fail("pthread_create");
+	warm_saver(t);
+	pthread_join(th, NULL);
+	if (!(f = fopen(path, "r")))
+		fail(path);
+	for (lines = 0; fgets(line, sizeof(line), f); lines++)
+		CHECK(strtoul(line, &p, 10) < 1000 && *p == ' ' && strchr(p, '\n'));
+	fclose(f);
+	CHECK(lines == 2002);
+}
+
+/*
+ * Directories are only kept open for lookups when they are trusted for a
+ * while without checking, and then lookups start from them.
+ */
+static void test_dir_fds(void)
+{
+	struct tree *t;
+	char buf[256];
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		create("fds/Deep/Er/file%u.txt", i);
+	t = tree_of("fds", NULL);
+	CHECK(!strcmp(correct(t, "deep/er/FILE0.TXT", buf, sizeof(buf)), "0:Deep/Er/file0.txt"));
+	CHECK(!strcmp(correct(t, "DEEP/ER/File1.txt", buf, sizeof(buf)), "0:Deep/Er/file1.txt"));
+	CHECK(t->dcache.opened == 0);
+
+	conf.cache_timeout = 60;
+	CHECK(!strcmp(correct(t, "deep/eR/file2.TXT", buf, sizeof(buf)), "0:Deep/Er/file2.txt"));
+	CHECK(t->dcache.opened > 0);
+	CHECK(!strcmp(correct(t, "deep/ER/fiLe3.txt", buf, sizeof(buf)), "0:Deep/Er/file3.txt"));
+	conf.cache_timeout = 0;
+}
+
+// Runs the control command line on t mounted at /mnt, returning its answer.
+static const char *control(struct tree *t, const char *line, char *buf, size_t size)
+{
+	struct mount mnt = { .mountpoint = "/mnt", .tree = t };
+	char copy[256];
+	ssize_t len;
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		fail("socketpair");
+	mounts = &mnt;
+	snprintf(copy, sizeof(copy), "%s", line);
+	control_command(sv[0], copy);
+	mounts = NULL;
+	close(sv[0]);
+	len = read(sv[1], buf, size - 1);
+	buf[len > 0 ? len : 0] = '\0';
+	close(sv[1]);
+	return buf;
+}
+
+/*
+ * Warming indexes every directory under a path in every layer that has
+ * it as a directory, and a client that sends nothing does not keep the
+ * others waiting.
+ */
+static void test_control(void)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct pollfd pfd = { .events = POLLIN };
+	struct tree *t;
+	pthread_t th;
+	char path[PATH_MAX], buf[256];
+	int indexed, watched, idle;
+	unsigned long builds;
+
+	create("ctl/over/Site/Img/a.png");
+	create("ctl/over/Site/docs");
+	create("ctl/under/site/img/b.png");
+	create("ctl/under/site/Css/c.css");
+	create("ctl/under/site/docs/d.txt");
+	t = tree_of("ctl/over:ctl/under", NULL);
+
+	builds = t->stats.builds;
+	CHECK(!strcmp(control(t, "warm /mnt/SITE", buf, sizeof(buf)), "indexed 3\nok\n"));
+	CHECK(t->stats.builds == builds + 5);
+	node_gen(t, "SITE/Img", &watched, &indexed);
+	CHECK(indexed);
+	node_gen(t, "SITE/Css", &watched, &indexed);
+	CHECK(indexed);
+	node_gen(t, "SITE/docs", &watched, &indexed);
+	CHECK(!indexed);
+	CHECK(!strcmp(correct(t, "site/img/B.PNG", buf, sizeof(buf)), "1:site/img/b.png"));
+	CHECK(!strncmp(control(t, "warm /mnt/nowhere", buf, sizeof(buf)), "error: ", 7));
+
+	snprintf(path, sizeof(path), "%s/ctl.sock", scratch);
+	control_path = path;
+	if (control_open("test") == -1 || pthread_create(&th, NULL, control_thread, NULL))
+		fail("control");
+	strcpy(sun.sun_path, path);
+	if ((idle = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(idle, (struct sockaddr*)&sun, sizeof(sun)) == -1 ||
+	    (pfd.fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    connect(pfd.fd, (struct sockaddr*)&sun, sizeof(sun)) == -1)
+		fail(path);
+	if (write(pfd.fd, "stats\n", 6) != 6)
+		fail("write");
+	CHECK(poll(&pfd, 1, (CONTROL_IDLE + 5) * 1000) == 1);
+	close(pfd.fd);
+	close(idle);
+	shutdown(control_fd, SHUT_RDWR);
+	pthread_join(th, NULL);
+	close(control_fd);
+	control_fd = -1;
+	control_path = NULL;
+	unlink(path);
+}
+
+/*
+ * Settings given on the command line win over those of the configuration
+ * file, which win over the defaults, when starting and reloading alike.
+ */
+static void test_config(void)
+{
+	static char *argv[] = { "fuzzyfs", "-o", "cache_size=200,warm_file=/cmdline/warm", NULL };
+	struct fuzzyfs_config c, defaults = conf_defaults;
+	struct policy_rule *rules;
+	char path[PATH_MAX];
+	int reload;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/fuzzyfs.conf", scratch);
+	if (!(f = fopen(path, "w")))
+		fail(path);
+	fprintf(f, "# settings\ncache_size 100\nindex_threshold 9\nwarm_file /file/warm\n"
+		"warm_file /file/warm2\nlog_level debug\npolicy / frozen\n");
+	fclose(f);
+	conf_defaults = conf;
+	conf_defaults.index_threshold = 4;
+	conf_defaults.dir_fds = 7;
+	conf.config = path;
+	cmdline.argc = 3;
+	cmdline.argv = argv;
+
+	for (reload = FALSE; reload <= TRUE; reload++)
+	{
+		if (config_build("test", &c, reload, &rules) == -1)
+			fail("config_build");
+		CHECK(c.cache_size == 200);
+		CHECK(c.warm_file && !strcmp(c.warm_file, "/cmdline/warm"));
+		CHECK(c.index_threshold == 9);
+		CHECK(c.log_level && !strcmp(c.log_level, "debug"));
+		CHECK(c.dir_fds == 7);
+		CHECK(rules && !rules->next);
+		policy_free(rules);
+		config_free(&c);
+	}
+
+	conf.config = NULL;
+	cmdline.argc = 0;
+	cmdline.argv = NULL;
+	conf_defaults = defaults;
+}
+
+// Does a scan as soon as it gets its turn.
+static void *resolver(void *arg)
+{
+	int *done = arg;
+
+	resolve_leave(resolve_enter(RESOLVE_MIN));
+	__atomic_store_n(done, TRUE, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// A scan waiting for its turn gets it once a reload raises resolvers.
+static void test_resolvers(void)
+{
+	static char *argv[] = { "fuzzyfs", NULL };
+	struct fuzzyfs_config saved = conf, defaults = conf_defaults;
+	char path[PATH_MAX];
+	pthread_t th;
+	int done = FALSE, i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/resolvers.conf", scratch);
+	if (!(f = fopen(path, "w")))
+		fail(path);
+	fprintf(f, "resolvers 2\nlog_level warn\n");
+	fclose(f);
+
+	// one scan is running and another waits
+	conf.resolvers = 1;
+	resolve.running = 1;
+	if (pthread_create(&th, NULL, resolver, &done))
+		fail("pthread_create");
+	usleep(100000);
+	CHECK(!__atomic_load_n(&done, __ATOMIC_ACQUIRE));
+
+	conf.config = path;
+	conf_defaults = conf;
+	cmdline.argc = 1;
+	cmdline.argv = argv;
+	config_reload();
+	for (i = 0; i < 100 && !__atomic_load_n(&done, __ATOMIC_ACQUIRE); i++)
+		usleep(10000);
+	CHECK(__atomic_load_n(&done, __ATOMIC_ACQUIRE));
+
+	pthread_mutex_lock(&resolve.lock);
+	resolve.running--;
+	pthread_cond_broadcast(&resolve.turn[0]);
+	pthread_mutex_unlock(&resolve.lock);
+	pthread_join(th, NULL);
+	free(conf.log_level);
+	conf = saved;
+	conf_defaults = defaults;
+	cmdline.argc = 0;
+	cmdline.argv = NULL;
+	log_prio = LOG_WARNING;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+
+	return remove(path);
+}
+
+int main(void)
+{
+	static const struct
+	{
+		const char *name;
+		void (*run)(void);
+	} tests[] = {
+		{ "hash", test_hash },
+		{ "tokens", test_tokens },
+		{ "index", test_index },
+		{ "collision", test_collision },
+		{ "shared", test_shared },
+		{ "listing", test_listing },
+		{ "filter", test_filter },
+		{ "shm", test_shm },
+		{ "shm race", test_shm_race },
+		{ "generations", test_generations },
+		{ "adaptive index", test_adaptive_index },
+		{ "adaptive ttl", test_adaptive_ttl },
+		{ "layers", test_layers },
+		{ "watch trees", test_watch_trees },
+		{ "warm file", test_warm },
+		{ "dir fds", test_dir_fds },
+		{ "control", test_control },
+		{ "config", test_config },
+		{ "resolvers", test_resolvers },
+	};
+	unsigned int i;
+	int before;
+
+	if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key))
+		fail("getrandom");
+	if (!mkdtemp(scratch))
+		fail(scratch);
+	log_prio = LOG_WARNING;
+
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		current = tests[i].name;
+		before = failures;
+		tests[i].run();
+		printf("%-16s%s\n", tests[i].name, failures == before ? "ok" : "FAILED");
+	}
+
+	nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return failures ? 1 : 0;
+}